@@ -1,18 +1,41 @@
 // SPDX-License-Identifier: BSD-2-Clause
 // Copyright © 2021 Billy Laws
 
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
 #include <cstdio>
 #include <cstdlib>
+#include <cinttypes>
+#include <cstring>
 #include <errno.h>
 #include <dlfcn.h>
+#include <link.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <android/dlext.h>
 #include <android/log.h>
 #include <android/api-level.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/sysmacros.h>
+#include <time.h>
+#include <linux/memfd.h>
 #include "elf_soname_patcher.h"
+#include "event_log.h"
+#include "linker_symbol_cache.h"
+#include "loaded_symbol_lookup.h"
+#include "trace.h"
 #include "android_linker_ns.h"
 
 using loader_android_create_namespace_t = android_namespace_t *(*)(const char *, const char *, const char *, uint64_t, const char *, android_namespace_t *, const void *);
@@ -20,10 +43,67 @@ static loader_android_create_namespace_t loader_android_create_namespace;
 
 static bool lib_loaded;
 
+static std::array<char, PATH_MAX> symbolCacheDir; //!< The directory holding the cache of resolved linker symbols, empty if caching is disabled
+
+static void resolve_linker_symbols();
+static int get_mapping_protection(uintptr_t address);
+
+/**
+ * @brief Resolves the linker symbols the first time any part of the library that needs them is used
+ * @note This is done lazily so processes that never touch namespaces don't pay for it
+ * @return true if loading succeeded
+ */
+static bool ensure_linker_symbols() {
+    static std::once_flag resolveFlag;
+    std::call_once(resolveFlag, resolve_linker_symbols);
+    return lib_loaded;
+}
+
+/**
+ * @brief Creates a namespace through the linker, recording it in the load event log
+ */
+static android_namespace_t *create_namespace(const char *name, const char *ldLibraryPath, const char *defaultLibraryPath, uint64_t type,
+                                             const char *permittedWhenIsolatedPath, android_namespace_t *parent, const void *caller) {
+    auto start{get_time_ns()};
+    auto ns{loader_android_create_namespace(name, ldLibraryPath, defaultLibraryPath, type, permittedWhenIsolatedPath, parent, caller)};
+    linkernsbypass_event event{};
+    event.duration_ns = get_time_ns() - start;
+    event.ns = ns;
+    event.unique_id = -1;
+    event.type = LINKERNSBYPASS_EVENT_NAMESPACE_CREATE;
+    event_log_record(event, name);
+    return ns;
+}
+
+/**
+ * @brief Links `from` to `to` through the linker, recording it in the load event log
+ * @param sharedLibsSonames The libraries to share, or nullptr to share all of them
+ */
+static bool link_namespaces(android_namespace_t *from, android_namespace_t *to, const char *sharedLibsSonames) {
+    auto start{get_time_ns()};
+    bool linked{sharedLibsSonames ? android_link_namespaces(from, to, sharedLibsSonames) : android_link_namespaces_all_libs(from, to)};
+    linkernsbypass_event event{};
+    event.duration_ns = get_time_ns() - start;
+    event.ns = from;
+    event.linked_ns = to;
+    event.unique_id = -1;
+    event.type = LINKERNSBYPASS_EVENT_NAMESPACE_LINK;
+    event.error = linked ? 0 : -1;
+    event_log_record(event, sharedLibsSonames);
+    return linked;
+}
 
 /* Public API */
 bool linkernsbypass_load_status() {
-    return lib_loaded;
+    return ensure_linker_symbols();
+}
+
+void linkernsbypass_set_tracing(bool enabled) {
+    TracingEnabled.store(enabled, std::memory_order_relaxed);
+}
+
+void linkernsbypass_set_symbol_cache_dir(const char *cacheDir) {
+    snprintf(symbolCacheDir.data(), symbolCacheDir.size(), "%s", cacheDir ? cacheDir : "");
 }
 
 struct android_namespace_t *android_create_namespace(const char *name,
@@ -32,9 +112,13 @@ struct android_namespace_t *android_create_namespace(const char *name,
                                                      uint64_t type,
                                                      const char *permitted_when_isolated_path,
                                                      android_namespace_t *parent_namespace) {
+    if (!ensure_linker_symbols())
+        return nullptr;
+
+    TraceSection trace{"android_create_namespace"};
     auto caller{__builtin_return_address(0)};
-    return loader_android_create_namespace(name, ld_library_path, default_library_path, type,
-                                           permitted_when_isolated_path, parent_namespace, caller);
+    return create_namespace(name, ld_library_path, default_library_path, type,
+                            permitted_when_isolated_path, parent_namespace, caller);
 }
 
 struct android_namespace_t *android_create_namespace_escape(const char *name,
@@ -43,9 +127,13 @@ struct android_namespace_t *android_create_namespace_escape(const char *name,
                                                             uint64_t type,
                                                             const char *permitted_when_isolated_path,
                                                             android_namespace_t *parent_namespace) {
+    if (!ensure_linker_symbols())
+        return nullptr;
+
+    TraceSection trace{"android_create_namespace_escape"};
     auto caller{reinterpret_cast<void *>(&dlopen)};
-    return loader_android_create_namespace(name, ld_library_path, default_library_path, type,
-                                           permitted_when_isolated_path, parent_namespace, caller);
+    return create_namespace(name, ld_library_path, default_library_path, type,
+                            permitted_when_isolated_path, parent_namespace, caller);
 }
 
 android_get_exported_namespace_t android_get_exported_namespace;
@@ -54,20 +142,223 @@ android_link_namespaces_all_libs_t android_link_namespaces_all_libs;
 
 android_link_namespaces_t android_link_namespaces;
 
-bool linkernsbypass_link_namespace_to_default_all_libs(android_namespace_t *to) {
+namespace {
+    /**
+     * @brief The configuration of a namespace created through the registry along with the namespace itself
+     */
+    struct NamespaceEntry {
+        std::string name;
+        std::string ldLibraryPath;
+        std::string defaultLibraryPath;
+        uint64_t type;
+        std::string permittedWhenIsolatedPath;
+        android_namespace_t *parent;
+        const void *callerBase; //!< The base address of the library that created the namespace, the linker takes the parent from this when `parent` is null
+        android_namespace_t *ns;
+    };
+}
+
+static std::mutex namespaceRegistryMutex;
+static std::vector<NamespaceEntry> namespaceRegistry;
+
+/**
+ * @brief Looks up a namespace with the supplied configuration in the registry, creating and adding it if there is none
+ */
+static android_namespace_t *get_or_create_namespace(const char *name, const char *ldLibraryPath, const char *defaultLibraryPath, uint64_t type,
+                                                    const char *permittedWhenIsolatedPath, android_namespace_t *parent, const void *caller) {
+    if (!ensure_linker_symbols())
+        return nullptr;
+
+    // Different call sites in the same library have the same caller namespace, so the library is all that needs to match
+    Dl_info callerInfo{};
+    const void *callerBase{dladdr(caller, &callerInfo) ? callerInfo.dli_fbase : caller};
+
+    // The linker treats null paths the same as empty ones
+    auto orEmpty{[](const char *string) { return string ? string : ""; }};
+
+    std::scoped_lock lock{namespaceRegistryMutex};
+    auto entry{std::find_if(namespaceRegistry.begin(), namespaceRegistry.end(), [&](const NamespaceEntry &entry) {
+        return entry.name == orEmpty(name) && entry.ldLibraryPath == orEmpty(ldLibraryPath) && entry.defaultLibraryPath == orEmpty(defaultLibraryPath) &&
+            entry.type == type && entry.permittedWhenIsolatedPath == orEmpty(permittedWhenIsolatedPath) && entry.parent == parent && entry.callerBase == callerBase;
+    })};
+    if (entry != namespaceRegistry.end())
+        return entry->ns;
+
+    TraceSection trace{"android_create_namespace"};
+    auto ns{create_namespace(name, ldLibraryPath, defaultLibraryPath, type, permittedWhenIsolatedPath, parent, caller)};
+    if (ns)
+        namespaceRegistry.push_back({orEmpty(name), orEmpty(ldLibraryPath), orEmpty(defaultLibraryPath), type, orEmpty(permittedWhenIsolatedPath), parent, callerBase, ns});
+
+    return ns;
+}
+
+struct android_namespace_t *linkernsbypass_get_or_create_namespace(const char *name,
+                                                                   const char *ld_library_path,
+                                                                   const char *default_library_path,
+                                                                   uint64_t type,
+                                                                   const char *permitted_when_isolated_path,
+                                                                   android_namespace_t *parent_namespace) {
+    return get_or_create_namespace(name, ld_library_path, default_library_path, type, permitted_when_isolated_path, parent_namespace, __builtin_return_address(0));
+}
+
+struct android_namespace_t *linkernsbypass_get_or_create_namespace_escape(const char *name,
+                                                                          const char *ld_library_path,
+                                                                          const char *default_library_path,
+                                                                          uint64_t type,
+                                                                          const char *permitted_when_isolated_path,
+                                                                          android_namespace_t *parent_namespace) {
+    return get_or_create_namespace(name, ld_library_path, default_library_path, type, permitted_when_isolated_path, parent_namespace, reinterpret_cast<void *>(&dlopen));
+}
+
+struct android_namespace_t *linkernsbypass_get_default_namespace() {
     // Creating a shared namespace with the default parent will give a copy of the default namespace that we can actually access
     // This is needed since there is no way to access a direct handle to the default namespace as it's not exported
-    static auto defaultNs{android_create_namespace_escape("default_copy", nullptr, nullptr, ANDROID_NAMESPACE_TYPE_SHARED, nullptr, nullptr)};
-    return android_link_namespaces_all_libs(to, defaultNs);
+    static auto defaultNs{linkernsbypass_get_or_create_namespace_escape("default_copy", nullptr, nullptr, ANDROID_NAMESPACE_TYPE_SHARED, nullptr, nullptr)};
+    return defaultNs;
 }
 
-void *linkernsbypass_namespace_dlopen(const char *filename, int flags, android_namespace_t *ns) {
-    android_dlextinfo extInfo{
-        .flags = ANDROID_DLEXT_USE_NAMESPACE,
-        .library_namespace = ns
+bool linkernsbypass_link_namespace_to_default_all_libs(android_namespace_t *to) {
+    auto defaultNs{linkernsbypass_get_default_namespace()};
+    if (!defaultNs)
+        return false;
+
+    TraceSection trace{"linkernsbypass_link_namespace_to_default_all_libs"};
+    return link_namespaces(to, defaultNs, nullptr);
+}
+
+bool linkernsbypass_link_namespace_to_default(android_namespace_t *to, const char *sharedLibsSonames) {
+    auto defaultNs{linkernsbypass_get_default_namespace()};
+    if (!defaultNs)
+        return false;
+
+    TraceSection trace{"linkernsbypass_link_namespace_to_default"};
+    return link_namespaces(to, defaultNs, sharedLibsSonames);
+}
+
+bool linkernsbypass_create_namespace_graph(const linkernsbypass_namespace_node *nodes, size_t nodeCount, const linkernsbypass_namespace_edge *edges, size_t edgeCount, android_namespace_t **namespaces) {
+    TraceSection trace{"linkernsbypass_create_namespace_graph"};
+    auto caller{__builtin_return_address(0)};
+
+    // Malformed edges are rejected before anything is created, rather than surfacing as a failed link once the rest of the graph exists
+    for (size_t i{}; i < edgeCount; i++) {
+        auto &edge{edges[i]};
+        bool validIndices{edge.from >= 0 && static_cast<size_t>(edge.from) < nodeCount && edge.to >= -1 && edge.to < static_cast<int>(nodeCount) && edge.from != edge.to};
+
+        // The linker refuses to link with an empty soname list, sharing every library needs nullptr instead
+        bool validSonames{!edge.shared_libs_sonames || edge.shared_libs_sonames[strspn(edge.shared_libs_sonames, ":")] != '\0'};
+        if (!validIndices || !validSonames) {
+            std::fill(namespaces, namespaces + nodeCount, nullptr);
+            errno = EINVAL;
+            return false;
+        }
+    }
+
+    bool createdAll{true};
+    for (size_t i{}; i < nodeCount; i++) {
+        auto &node{nodes[i]};
+        bool validParent{node.parent < 0 || (static_cast<size_t>(node.parent) < i && namespaces[node.parent])};
+        namespaces[i] = validParent ? get_or_create_namespace(node.name, node.ld_library_path, node.default_library_path, node.type, node.permitted_when_isolated_path,
+                                                              node.parent < 0 ? nullptr : namespaces[node.parent], caller) : nullptr;
+        createdAll &= namespaces[i] != nullptr;
+    }
+
+    // Merge every edge between the same pair of namespaces so each pair is only linked once
+    struct Link {
+        int from, to;
+        bool allLibs;
+        std::vector<std::string> sonames;
     };
+    std::vector<Link> links;
+
+    for (size_t i{}; i < edgeCount; i++) {
+        auto &edge{edges[i]};
+        auto link{std::find_if(links.begin(), links.end(), [&edge](const Link &link) { return link.from == edge.from && link.to == edge.to; })};
+        if (link == links.end())
+            link = links.insert(links.end(), Link{edge.from, edge.to, false, {}});
+
+        if (!edge.shared_libs_sonames) {
+            link->allLibs = true;
+            continue;
+        }
+
+        for (const char *soname{edge.shared_libs_sonames}; *soname;) {
+            auto end{strchrnul(soname, ':')};
+            std::string name{soname, static_cast<size_t>(end - soname)};
+            if (!name.empty() && std::find(link->sonames.begin(), link->sonames.end(), name) == link->sonames.end())
+                link->sonames.push_back(std::move(name));
+            soname = *end ? end + 1 : end;
+        }
+    }
+
+    bool linkedAll{true};
+    for (auto &link : links) {
+        auto from{namespaces[link.from]};
+        auto to{link.to < 0 ? linkernsbypass_get_default_namespace() : namespaces[link.to]};
+        if (!from || !to) {
+            linkedAll = false;
+            continue;
+        }
+
+        if (link.allLibs) {
+            linkedAll &= link_namespaces(from, to, nullptr);
+        } else {
+            std::string sonames;
+            for (auto &soname : link.sonames)
+                sonames.append(sonames.empty() ? "" : ":").append(soname);
+            linkedAll &= link_namespaces(from, to, sonames.c_str());
+        }
+    }
+
+    return createdAll && linkedAll;
+}
+
+void *linkernsbypass_namespace_dlopen(const char *filename, int flags, android_namespace_t *ns) {
+    return linkernsbypass_namespace_dlopen_ext(filename, flags, ns, nullptr);
+}
+
+void *linkernsbypass_namespace_dlopen_ext(const char *filename, int flags, android_namespace_t *ns, const android_dlextinfo *extInfo) {
+    android_dlextinfo nsExtInfo{extInfo ? *extInfo : android_dlextinfo{}};
+    nsExtInfo.flags |= ANDROID_DLEXT_USE_NAMESPACE;
+    nsExtInfo.library_namespace = ns;
 
-    return android_dlopen_ext(filename, flags, &extInfo);
+    auto start{get_time_ns()};
+    auto handle{android_dlopen_ext(filename, flags, &nsExtInfo)};
+    linkernsbypass_event event{};
+    event.duration_ns = get_time_ns() - start;
+    event.ns = ns;
+    event.handle = handle;
+    event.unique_id = -1;
+    event.type = LINKERNSBYPASS_EVENT_LOAD;
+    event_log_record(event, filename);
+    return handle;
+}
+
+size_t linkernsbypass_dlsym_bulk(void *handle, const char *const *names, size_t count, void **addresses) {
+    TraceSection trace{"linkernsbypass_dlsym_bulk"};
+
+    // The handle is opaque so the library has to be found through the address of a symbol in it
+    size_t anchor{};
+    for (; anchor < count; anchor++)
+        if ((addresses[anchor] = dlsym(handle, names[anchor])))
+            break;
+
+    if (anchor == count)
+        return 0;
+
+    // The anchor may have come from a dependency of the library rather than the library itself, looking the rest up in it directly would then break the precedence dlsym follows
+    size_t rest{anchor + 1};
+    size_t resolved{1};
+    if (loaded_object_is_needed(addresses[anchor]))
+        std::fill(addresses + rest, addresses + count, nullptr);
+    else
+        resolved += loaded_symbol_lookup(addresses[anchor], names + rest, count - rest, addresses + rest);
+
+    // Anything the library doesn't define itself can still come from its dependencies
+    for (size_t i{rest}; i < count; i++)
+        if (!addresses[i] && (addresses[i] = dlsym(handle, names[i])))
+            resolved++;
+
+    return resolved;
 }
 
 #ifndef __NR_memfd_create
@@ -78,114 +369,2143 @@ void *linkernsbypass_namespace_dlopen(const char *filename, int flags, android_n
     #endif
 #endif
 
-void *linkernsbypass_namespace_dlopen_unique(const char *libPath, const char *libTargetDir, int flags, android_namespace_t *ns) {
-    static std::array<char, PATH_MAX> PathBuf{};
+namespace {
+    /**
+     * @brief Adds the page faults incurred by the current thread over its lifetime to `stats`
+     */
+    class FaultCounter {
+      private:
+        linkernsbypass_unique_stats &stats;
+        rusage start{};
 
-    // Used as a unique ID for overwriting soname and creating target lib files
-    static uint16_t TargetId{};
+      public:
+        FaultCounter(linkernsbypass_unique_stats &stats) : stats{stats} {
+            getrusage(RUSAGE_THREAD, &start);
+        }
 
-    int libTargetFd{[&] () {
-        if (libTargetDir) {
-            snprintf(PathBuf.data(), PathBuf.size(), "%s/%d_patched.so", libTargetDir, TargetId);
-            return open(PathBuf.data(), O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
-        } else {
-            // If memfd isn't supported errno will contain ENOSYS after calling
-            errno = 0;
-            int fd{static_cast<int>(syscall(__NR_memfd_create, libPath, 0))};
-            if (errno == ENOSYS || fd < 0)
-                return -1;
-            else
-                return fd;
+        ~FaultCounter() {
+            rusage end{};
+            getrusage(RUSAGE_THREAD, &end);
+            stats.minor_faults += static_cast<uint64_t>(end.ru_minflt - start.ru_minflt);
+            stats.major_faults += static_cast<uint64_t>(end.ru_majflt - start.ru_majflt);
         }
-    }()};
-    if (libTargetFd == -1)
+    };
+}
+
+static std::mutex globalStatsMutex;
+static linkernsbypass_unique_stats globalStats; //!< The accumulated stats of every unique load in the process
+
+/**
+ * @brief Accumulates the stats of a single unique load into the global stats and the caller supplied stats in `info`, if any
+ */
+static void record_unique_stats(const linkernsbypass_unique_stats &stats, const linkernsbypass_unique_info *info) {
+    auto accumulate{[&stats](linkernsbypass_unique_stats &target) {
+        target.loads += stats.loads;
+        target.memfd_targets += stats.memfd_targets;
+        target.file_targets += stats.file_targets;
+        target.cache_hits += stats.cache_hits;
+        target.target_create_ns += stats.target_create_ns;
+        target.parse_ns += stats.parse_ns;
+        target.copy_ns += stats.copy_ns;
+        target.patch_ns += stats.patch_ns;
+        target.dlopen_ns += stats.dlopen_ns;
+        target.bytes_copied += stats.bytes_copied;
+        target.minor_faults += stats.minor_faults;
+        target.major_faults += stats.major_faults;
+        target.direct_loads += stats.direct_loads;
+        target.prewarm_hits += stats.prewarm_hits;
+        target.bytes_reclaimed += stats.bytes_reclaimed;
+        target.prepatched_loads += stats.prepatched_loads;
+    }};
+
+    if (info && info->stats)
+        accumulate(*info->stats);
+
+    std::scoped_lock lock{globalStatsMutex};
+    accumulate(globalStats);
+}
+
+void linkernsbypass_get_unique_stats(linkernsbypass_unique_stats *stats) {
+    std::scoped_lock lock{globalStatsMutex};
+    *stats = globalStats;
+}
+
+void linkernsbypass_reset_unique_stats() {
+    std::scoped_lock lock{globalStatsMutex};
+    globalStats = {};
+}
+
+constexpr size_t HugePageSize{2 * 1024 * 1024};
+
+static void *reserve_address_space(void *address, size_t size, int flags) {
+    auto reservation{mmap(address, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | flags, -1, 0)};
+    if (reservation == MAP_FAILED)
+        event_log_failure(LINKERNSBYPASS_EVENT_CALL_MMAP, nullptr);
+    return reservation;
+}
+
+/**
+ * @brief Reserves `size` bytes of address space starting at an address congruent to `offset` modulo `alignment`
+ * @return The start of the reservation, or nullptr on failure
+ */
+static void *reserve_aligned_address_space(size_t size, size_t alignment, size_t offset) {
+    size_t paddedSize{size + alignment};
+    void *padded{reserve_address_space(nullptr, paddedSize, 0)};
+    if (padded == MAP_FAILED)
         return nullptr;
 
-    // Partially overwrite soname with 3 digits (replacing lib...) with to make sure a cached so isn't loaded
-    std::array<char, 3> sonameOverwrite{};
-    snprintf(sonameOverwrite.data(), sonameOverwrite.size(), "%03u", TargetId++);
+    auto start{reinterpret_cast<uintptr_t>(padded)};
+    auto aligned{start + ((offset - start) & (alignment - 1))};
+
+    // Trim the padding on either side so only the aligned region stays reserved
+    if (aligned != start)
+        munmap(padded, aligned - start);
+    if (auto end{aligned + size}; end != start + paddedSize)
+        munmap(reinterpret_cast<void *>(end), start + paddedSize - end);
+
+    return reinterpret_cast<void *>(aligned);
+}
+
+/**
+ * @brief Copies `srcFd` into the memfd `targetFd` through a MADV_HUGEPAGE mapping so shmem backs it with huge pages
+ * @note shmem only allocates huge pages for writes through write() when shmem_enabled is always or within_size, faulting them in through a hinted mapping covers advise too
+ * @return false if huge pages aren't supported, in which case the target should be filled with elf_copy_file instead
+ */
+static bool copy_into_huge_pages(int srcFd, int targetFd, uint64_t size) {
+    // Huge pages are only used inside the file size, so round it up to a whole number of them
+    auto mappedSize{static_cast<size_t>((size + HugePageSize - 1) & ~static_cast<uint64_t>(HugePageSize - 1))};
+    if (!mappedSize || ftruncate(targetFd, 0) == -1 || ftruncate(targetFd, static_cast<off_t>(mappedSize)) == -1)
+        return false;
+
+    void *reservation{reserve_aligned_address_space(mappedSize, HugePageSize, 0)};
+    if (!reservation)
+        return false;
+
+    auto mapping{static_cast<uint8_t *>(mmap(reservation, mappedSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, targetFd, 0))};
+    if (mapping == MAP_FAILED) {
+        munmap(reservation, mappedSize);
+        return false;
+    }
+
+    bool copied{madvise(mapping, mappedSize, MADV_HUGEPAGE) == 0};
+    for (uint64_t offset{}; copied && offset < size;) {
+        ssize_t ret{pread(srcFd, mapping + offset, static_cast<size_t>(size - offset), static_cast<off_t>(offset))};
+        copied = ret > 0;
+        offset += copied ? static_cast<uint64_t>(ret) : 0;
+    }
+
+    munmap(mapping, mappedSize);
+    return copied;
+}
+
+/**
+ * @brief Copies the already located library in `libFd` into `targetFd` and patches its soname, recording the time spent in each stage
+ * @param hugePages If `targetFd` is a memfd that should be backed by huge pages
+ */
+static bool patch_unique_target(int libFd, const elf_soname_location &location, int targetFd, const char *sonamePatch, linkernsbypass_unique_stats &stats, bool hugePages = false) {
+    TraceSection trace{"elf_soname_patch"};
+
+    auto copyStart{get_time_ns()};
+    if (!(hugePages && copy_into_huge_pages(libFd, targetFd, location.size)) && !elf_copy_file(libFd, targetFd, location.size)) {
+        event_log_failure(LINKERNSBYPASS_EVENT_CALL_COPY, nullptr);
+        return false;
+    }
+
+    auto patchStart{get_time_ns()};
+    stats.copy_ns += patchStart - copyStart;
+    stats.bytes_copied += location.size;
+
+    bool written{elf_soname_write(targetFd, &location, sonamePatch)};
+    if (!written)
+        event_log_failure(LINKERNSBYPASS_EVENT_CALL_WRITE, nullptr);
+
+    stats.patch_ns += get_time_ns() - patchStart;
+    return written;
+}
+
+// FNV-1a, only used to give cached libraries a stable per-source filename
+static uint64_t hash_path(const char *path) {
+    uint64_t hash{0xcbf29ce484222325};
+    for (; *path; path++)
+        hash = (hash ^ static_cast<uint8_t>(*path)) * 0x100000001b3;
+    return hash;
+}
+
+/**
+ * @brief Checks that a cached copy has its soname at the same location as in the source library and that the soname was patched with `sonamePatch`
+ * @note This catches copies that were truncated or patched differently, which matching the size and mtime alone can't
+ */
+static bool verify_cached_target(int libFd, int cachedFd, const elf_soname_location &location, const char *sonamePatch) {
+    elf_soname_location cachedLocation{};
+    if (!elf_soname_locate(cachedFd, &cachedLocation) || cachedLocation.offset != location.offset || cachedLocation.length != location.length || cachedLocation.size != location.size)
+        return false;
+
+    auto length{static_cast<ssize_t>(location.length)};
+    std::string expected(location.length, '\0'), cached(location.length, '\0');
+    if (pread(libFd, expected.data(), expected.size(), static_cast<off_t>(location.offset)) != length ||
+        pread(cachedFd, cached.data(), cached.size(), static_cast<off_t>(location.offset)) != length)
+        return false;
+
+    // Only the start of the soname is overwritten, the same as elf_soname_write
+    auto patchLength{std::min<size_t>(strlen(sonamePatch), expected.size())};
+    expected.replace(0, patchLength, sonamePatch, patchLength);
+    return cached == expected;
+}
+
+/**
+ * @brief Opens a soname patched copy of `libPath` from the persistent cache in `cacheDir`, creating it if it is missing or stale
+ * @note The cached copy has its size and mtime matched to the source library and its patched soname is checked with verify_cached_target before it's reused
+ */
+static int open_cached_target(const char *libPath, int libFd, const elf_soname_location &location, const char *cacheDir, const char *sonamePatch, uint32_t id, linkernsbypass_unique_stats &stats) {
+    struct stat libStat{};
+    if (fstat(libFd, &libStat))
+        return -1;
+
+    std::array<char, PATH_MAX> cachedPath{};
+    snprintf(cachedPath.data(), cachedPath.size(), "%s/%s_%016" PRIx64 "_patched.so", cacheDir, sonamePatch, hash_path(libPath));
+
+    int cachedFd{open(cachedPath.data(), O_RDONLY | O_CLOEXEC)};
+    if (cachedFd != -1) {
+        struct stat cachedStat{};
+        if (!fstat(cachedFd, &cachedStat) && cachedStat.st_size == libStat.st_size &&
+            cachedStat.st_mtim.tv_sec == libStat.st_mtim.tv_sec && cachedStat.st_mtim.tv_nsec == libStat.st_mtim.tv_nsec &&
+            verify_cached_target(libFd, cachedFd, location, sonamePatch)) {
+            stats.cache_hits++;
+            return cachedFd;
+        }
+
+        close(cachedFd);
+    }
+
+    // Patch into a temporary file and rename it into place at the end so a partially written copy can never be picked up
+    std::array<char, PATH_MAX> tempPath{};
+    snprintf(tempPath.data(), tempPath.size(), "%s.%d.%u.tmp", cachedPath.data(), getpid(), id);
+
+    int tempFd{open(tempPath.data(), O_CREAT | O_TRUNC | O_RDWR | O_CLOEXEC, S_IRUSR | S_IWUSR)};
+    if (tempFd == -1) {
+        event_log_failure(LINKERNSBYPASS_EVENT_CALL_OPEN, tempPath.data());
+        return -1;
+    }
+
+    stats.file_targets++;
+
+    timespec accessTime{};
+    accessTime.tv_nsec = UTIME_OMIT;
+    std::array<timespec, 2> times{accessTime, libStat.st_mtim};
+    if (!patch_unique_target(libFd, location, tempFd, sonamePatch, stats) || futimens(tempFd, times.data()) || rename(tempPath.data(), cachedPath.data())) {
+        close(tempFd);
+        unlink(tempPath.data());
+        return -1;
+    }
+
+    return tempFd;
+}
+
+static int create_memfd(const char *name, unsigned int flags) {
+    // If memfd isn't supported errno will contain ENOSYS after calling
+    errno = 0;
+    int fd{static_cast<int>(syscall(__NR_memfd_create, name, flags))};
+    if (errno == ENOSYS || fd < 0)
+        return -1;
+    else
+        return fd;
+}
+
+namespace {
+    /**
+     * @brief Hands out the unique IDs that are patched into sonames, always picking the lowest free ID so IDs released by unloaded instances get reused
+     */
+    class UniqueIdAllocator {
+      private:
+        std::mutex mutex;
+        std::vector<bool> used; //!< If each ID is currently in use by an instance
+
+      public:
+        /**
+         * @return A free ID below `limit`, or std::nullopt if every ID below it is in use
+         */
+        std::optional<uint32_t> Allocate(uint32_t limit) {
+            std::scoped_lock lock{mutex};
+            auto end{used.begin() + std::min<size_t>(limit, used.size())};
+            auto freeId{std::find(used.begin(), end, false)};
+            if (freeId != end) {
+                *freeId = true;
+                return static_cast<uint32_t>(freeId - used.begin());
+            } else if (used.size() < limit) {
+                used.push_back(true);
+                return static_cast<uint32_t>(used.size() - 1);
+            }
+            return std::nullopt;
+        }
+
+        void Release(uint32_t id) {
+            std::scoped_lock lock{mutex};
+            if (id < used.size())
+                used[id] = false;
+        }
+    };
+
+    /**
+     * @brief A soname patched copy of a library that is ready to be loaded
+     */
+    struct UniqueTarget {
+        int fd{-1};
+        std::optional<uint32_t> id; //!< The unique ID patched into the soname, this must be released once the instance is gone, this is empty for libraries loaded without a copy
+        std::array<char, PATH_MAX> path{}; //!< The path of the patched copy if it's a file that should be deleted once the instance is gone, empty otherwise
+        linkernsbypass_arena_t *arena{}; //!< The arena the instance was loaded into, if any
+        size_t arenaSlot{}; //!< The slot in `arena` holding the instance, this must be released once the instance is gone
+        elf_load_layout hugePageLayout{}; //!< The layout of the library if its copy is backed by huge pages, zeroed otherwise
+        void *reservation{}; //!< Address space reserved to load the instance at a huge page aligned address, this must be unmapped once the instance is gone
+        elf_soname_location sonameLocation{}; //!< The location of the patched soname in the copy
+        std::vector<elf_soname_location> rewriteLocations; //!< The locations of the DT_NEEDED strings rewritten in the copy
+        bool memfd{}; //!< If the copy is a memfd, which means its pages only exist in memory
+        int sourceFd{-1}; //!< The source library for LINKERNSBYPASS_UNIQUE_SHARE_UNMODIFIED, this is closed once the instance is loaded
+        dev_t device{}; //!< The device of the copy, used to find its mappings once the FD is closed
+        ino_t inode{}; //!< The inode of the copy, used to find its mappings once the FD is closed
+        std::array<char, PATH_MAX> soname{}; //!< The patched soname of the instance, read once it's loaded so unloading can tell if the linker actually dropped it
+    };
+
+    constexpr uint32_t DefaultIdWidth{3}; //!< Allows for 1000 simultaneous instances
+    constexpr uint32_t MaxIdWidth{9}; //!< The widest ID that fits in 32 bits
+    constexpr char SharedIdMarker{'s'}; //!< Prefixed to the IDs of copies shared with other processes, the IDs those allocate for their own instances are only digits so the two can't collide
+
+    using SonamePatch = std::array<char, MaxIdWidth + 1>;
+}
+
+static UniqueIdAllocator uniqueIds; //!< The only state shared between all unique loads
+
+struct linkernsbypass_arena_t {
+    std::mutex mutex;
+    uint8_t *base; //!< The start of the reserved region
+    size_t slotSize; //!< The page aligned size of each slot
+    std::vector<bool> used; //!< If each slot currently holds an instance
+};
+
+linkernsbypass_arena_t *linkernsbypass_arena_create(size_t slotSize, size_t slotCount) {
+    size_t pageSize{static_cast<size_t>(getpagesize())};
+    slotSize = (slotSize + pageSize - 1) & ~(pageSize - 1);
+    if (!slotSize || !slotCount || slotCount > SIZE_MAX / slotSize)
+        return nullptr;
 
-    if (!elf_soname_patch(libPath, libTargetFd, sonameOverwrite.data()))
+    void *base{reserve_address_space(nullptr, slotSize * slotCount, 0)};
+    if (base == MAP_FAILED)
         return nullptr;
 
-    // Load our patched library into the hook namespace
-    android_dlextinfo hookExtInfo{
-        .flags = ANDROID_DLEXT_USE_NAMESPACE | ANDROID_DLEXT_USE_LIBRARY_FD,
-        .library_fd = libTargetFd,
-        .library_namespace = ns
+    auto arena{new linkernsbypass_arena_t{}};
+    arena->base = static_cast<uint8_t *>(base);
+    arena->slotSize = slotSize;
+    arena->used.resize(slotCount);
+    return arena;
+}
+
+bool linkernsbypass_arena_destroy(linkernsbypass_arena_t *arena) {
+    if (!arena)
+        return true;
+
+    {
+        std::scoped_lock lock{arena->mutex};
+        if (std::find(arena->used.begin(), arena->used.end(), true) != arena->used.end())
+            return false;
+    }
+
+    munmap(arena->base, arena->slotSize * arena->used.size());
+    delete arena;
+    return true;
+}
+
+/**
+ * @return The lowest free slot in `arena`, or std::nullopt if every slot is in use
+ */
+static std::optional<size_t> allocate_arena_slot(linkernsbypass_arena_t *arena) {
+    std::scoped_lock lock{arena->mutex};
+    auto freeSlot{std::find(arena->used.begin(), arena->used.end(), false)};
+    if (freeSlot == arena->used.end())
+        return std::nullopt;
+
+    *freeSlot = true;
+    return static_cast<size_t>(freeSlot - arena->used.begin());
+}
+
+/**
+ * @brief Returns a slot to `arena` once the instance in it is gone
+ */
+static void release_arena_slot(linkernsbypass_arena_t *arena, size_t slot) {
+    // The linker already does this when unloading a library it mapped into caller reserved space, but not if loading failed part way or the slot was only used as a hint
+    if (reserve_address_space(arena->base + slot * arena->slotSize, arena->slotSize, MAP_FIXED) == MAP_FAILED)
+        return; // Leave the slot marked as used, it's better to lose it than to load into a region that may still have something mapped
+
+    std::scoped_lock lock{arena->mutex};
+    arena->used[slot] = false;
+}
+
+/**
+ * @brief Cleans up after a unique target that is no longer loaded (or never was), closing and deleting its copy and returning its ID and arena slot to their pools
+ */
+static void release_unique_target(UniqueTarget &target) {
+    if (target.fd != -1)
+        close(target.fd);
+
+    if (target.sourceFd != -1)
+        close(target.sourceFd);
+
+    if (target.path[0])
+        unlink(target.path.data());
+
+    if (target.arena)
+        release_arena_slot(target.arena, target.arenaSlot);
+
+    if (target.reservation)
+        munmap(target.reservation, target.hugePageLayout.load_size);
+
+    if (target.id)
+        uniqueIds.Release(*target.id);
+    target = {};
+}
+
+/**
+ * @brief Allocates a unique ID for an instance of the library with the soname at `location` and formats it as a soname patch
+ * @param width The requested number of digits in the ID, 0 for the default, this is limited to the length of the soname
+ * @param marker If non-zero this is prefixed to the ID in place of its first digit
+ */
+static std::optional<uint32_t> allocate_unique_id(const elf_soname_location &location, uint32_t width, SonamePatch &sonamePatch, char marker = '\0') {
+    width = std::min({width ? width : DefaultIdWidth, MaxIdWidth, static_cast<uint32_t>(location.length)});
+
+    // A marker takes the place of the first digit
+    uint32_t digits{marker && width ? width - 1 : width};
+    if (!digits)
+        return std::nullopt;
+
+    uint32_t limit{1};
+    for (uint32_t i{}; i < digits; i++)
+        limit *= 10;
+
+    auto id{uniqueIds.Allocate(limit)};
+    if (id && marker)
+        snprintf(sonamePatch.data(), sonamePatch.size(), "%c%0*u", marker, static_cast<int>(digits), *id);
+    else if (id)
+        // Partially overwrite soname with the digits of the ID (replacing lib...) to make sure a cached so isn't loaded
+        snprintf(sonamePatch.data(), sonamePatch.size(), "%0*u", static_cast<int>(digits), *id);
+
+    return id;
+}
+
+namespace {
+    /**
+     * @brief A string in .dynstr that is overwritten in a copy in addition to its soname
+     */
+    struct DynstrRewrite {
+        elf_soname_location location;
+        const char *patch;
     };
+}
 
-    // Make a path that looks about right
-    snprintf(PathBuf.data(), PathBuf.size(), "/proc/self/fd/%d", libTargetFd);
+/**
+ * @brief Fills `target`, which must already have an ID allocated, with a soname patched copy of the located library in `libFd`
+ * @param rewrites Other strings to overwrite in the copy, this must be empty if the persistent cache is used as cached copies are only keyed by their soname patch
+ * @note The FD of `target` is left as -1 on failure, `libFd` is not closed
+ */
+static void create_unique_target(const char *libPath, int libFd, const elf_soname_location &location, const char *sonamePatch, const std::vector<DynstrRewrite> &rewrites, const linkernsbypass_unique_info *info, UniqueTarget &target, linkernsbypass_unique_stats &stats) {
+    const char *libTargetDir{info->target_dir};
+    target.sonameLocation = location;
+    if (libTargetDir && (info->flags & LINKERNSBYPASS_UNIQUE_PERSISTENT_CACHE)) {
+        // The cached copy is either already patched or patched as part of opening it, so there's nothing more to do other than loading it
+        target.fd = open_cached_target(libPath, libFd, location, libTargetDir, sonamePatch, *target.id, stats);
+    } else {
+        auto createStart{get_time_ns()};
+        target.fd = [&] () {
+            if (libTargetDir) {
+                stats.file_targets++;
+
+                // An anonymous file never has a directory entry so nothing about it needs to be committed to storage
+                if (info->flags & LINKERNSBYPASS_UNIQUE_ANONYMOUS_FILE) {
+                    int fd{open(libTargetDir, O_TMPFILE | O_RDWR | O_CLOEXEC, S_IRUSR | S_IWUSR)};
+                    if (fd != -1)
+                        return fd;
+                }
+
+                snprintf(target.path.data(), target.path.size(), "%s/%s_patched.so", libTargetDir, sonamePatch);
+                int fd{open(target.path.data(), O_CREAT | O_RDWR, S_IRUSR | S_IWUSR)};
+
+                // Fall back to unlinking the file straight away on filesystems without O_TMPFILE support
+                if (fd != -1 && (info->flags & LINKERNSBYPASS_UNIQUE_ANONYMOUS_FILE)) {
+                    unlink(target.path.data());
+                    target.path[0] = '\0';
+                }
+                return fd;
+            } else {
+                stats.memfd_targets++;
+                target.memfd = true;
+                if (info->flags & LINKERNSBYPASS_UNIQUE_SHARE_UNMODIFIED)
+                    target.sourceFd = fcntl(libFd, F_DUPFD_CLOEXEC, 0);
+
+                return create_memfd(libPath, (info->flags & LINKERNSBYPASS_UNIQUE_SEALED) ? MFD_ALLOW_SEALING : 0);
+            }
+        }();
+        if (target.fd == -1)
+            event_log_failure(libTargetDir ? LINKERNSBYPASS_EVENT_CALL_OPEN : LINKERNSBYPASS_EVENT_CALL_MEMFD_CREATE, libPath);
+        stats.target_create_ns += get_time_ns() - createStart;
+
+        // MFD_HUGETLB isn't usable here as hugetlbfs can't be written to and needs every segment mapping to be huge page aligned, shmem THP has neither restriction
+        bool hugePages{!libTargetDir && (info->flags & LINKERNSBYPASS_UNIQUE_HUGE_PAGES) && elf_load_layout_read(libFd, &target.hugePageLayout)};
+        if (!hugePages)
+            target.hugePageLayout = {};
+
+        bool patched{target.fd != -1 && patch_unique_target(libFd, location, target.fd, sonamePatch, stats, hugePages)};
+
+        auto rewriteStart{get_time_ns()};
+        for (auto &rewrite : rewrites) {
+            if (patched && !elf_soname_write(target.fd, &rewrite.location, rewrite.patch)) {
+                event_log_failure(LINKERNSBYPASS_EVENT_CALL_WRITE, libPath);
+                patched = false;
+            }
+            target.rewriteLocations.push_back(rewrite.location);
+        }
+        stats.patch_ns += get_time_ns() - rewriteStart;
+
+        // Once sealed the contents of the memfd can never change, which makes it safe to share with other processes
+        if (patched && !libTargetDir && (info->flags & LINKERNSBYPASS_UNIQUE_SEALED)) {
+            patched = fcntl(target.fd, F_ADD_SEALS, F_SEAL_WRITE | F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != -1;
+            if (!patched)
+                event_log_failure(LINKERNSBYPASS_EVENT_CALL_SEAL, libPath);
+        }
+
+        if (target.fd != -1 && !patched) {
+            close(target.fd);
+            target.fd = -1;
+        }
+    }
 
-    return android_dlopen_ext(PathBuf.data(), flags, &hookExtInfo);
 }
 
-static void *align_ptr(void *ptr) {
-    return reinterpret_cast<void *>(reinterpret_cast<uintptr_t>(ptr) & ~(getpagesize() - 1));
+namespace {
+    /**
+     * @brief A soname patched copy created ahead of time by linkernsbypass_prewarm
+     */
+    struct PrewarmedTarget {
+        std::string libPath;
+        UniqueTarget target;
+    };
 }
 
-/* Private */
-__attribute__((constructor)) static void resolve_linker_symbols() {
-    using loader_dlopen_t = void *(*)(const char *, int, const void *);
+static std::mutex prewarmedTargetsMutex;
+static std::vector<PrewarmedTarget> prewarmedTargets;
 
-    if (android_get_device_api_level() < 28)
-        return;
+/**
+ * @brief Takes a prewarmed copy of `libPath` from the pool if there is one that was created the same way as `info` would create it
+ * @return The prewarmed copy, with an FD of -1 if there was none
+ */
+static UniqueTarget take_prewarmed_target(const char *libPath, const linkernsbypass_unique_info *info) {
+    // Prewarmed copies are always plain memfds with the default ID width
+    constexpr uint64_t IncompatibleFlags{LINKERNSBYPASS_UNIQUE_SEALED | LINKERNSBYPASS_UNIQUE_HUGE_PAGES | LINKERNSBYPASS_UNIQUE_SHARE_UNMODIFIED};
+    if (info->target_dir || (info->flags & IncompatibleFlags) || (info->id_width && info->id_width != DefaultIdWidth))
+        return {};
+
+    std::scoped_lock lock{prewarmedTargetsMutex};
+    auto prewarmed{std::find_if(prewarmedTargets.begin(), prewarmedTargets.end(), [libPath](const PrewarmedTarget &prewarmed) { return prewarmed.libPath == libPath; })};
+    if (prewarmed == prewarmedTargets.end())
+        return {};
+
+    auto target{prewarmed->target};
+    prewarmedTargets.erase(prewarmed);
+    return target;
+}
+
+/**
+ * @brief Creates a new soname patched copy of `libPath` that is ready to be loaded
+ * @param idMarker If non-zero this is prefixed to the unique ID in the soname, see allocate_unique_id
+ * @return The patched copy, with an FD of -1 on failure
+ */
+static UniqueTarget prepare_new_unique_target(const char *libPath, const linkernsbypass_unique_info *info, linkernsbypass_unique_stats &stats, char idMarker = '\0') {
+    FaultCounter faultCounter{stats};
+    stats.loads++;
+
+    auto parseStart{get_time_ns()};
+    int libFd{open(libPath, O_RDONLY | O_CLOEXEC)};
+    if (libFd == -1) {
+        event_log_failure(LINKERNSBYPASS_EVENT_CALL_OPEN, libPath);
+        return {};
+    }
+
+    UniqueTarget target{};
+    elf_soname_location location{};
+    errno = 0; // Left as is if the file could be read but isn't an elf with a soname
+    bool located{elf_soname_locate(libFd, &location)};
+    if (!located)
+        event_log_failure(LINKERNSBYPASS_EVENT_CALL_READ, libPath);
+    stats.parse_ns += get_time_ns() - parseStart;
+
+    SonamePatch sonamePatch{};
+    auto id{located ? allocate_unique_id(location, info->id_width, sonamePatch, idMarker) : std::nullopt};
+    if (located && !id)
+        event_log_failure(LINKERNSBYPASS_EVENT_CALL_ALLOCATE_ID, libPath, ENOSPC);
+
+    if (!id) {
+        close(libFd);
+        return {};
+    }
+    target.id = id;
+
+    create_unique_target(libPath, libFd, location, sonamePatch.data(), {}, info, target, stats);
+    close(libFd);
+
+    if (target.fd == -1)
+        release_unique_target(target);
+
+    return target;
+}
+
+/**
+ * @brief Like prepare_new_unique_target but takes a copy from the prewarmed pool instead if there is one
+ */
+static UniqueTarget prepare_unique_target(const char *libPath, const linkernsbypass_unique_info *info, linkernsbypass_unique_stats &stats) {
+    auto target{take_prewarmed_target(libPath, info)};
+    if (target.fd == -1)
+        return prepare_new_unique_target(libPath, info, stats);
+
+    stats.loads++;
+    stats.memfd_targets++;
+    stats.prewarm_hits++;
+    return target;
+}
+
+/**
+ * @brief Reads the string at `location` in .dynstr
+ * @param standalone Set to false if the string is the tail of a longer one (due to suffix merging of the string table), in which case it can't be rewritten without also changing the longer one
+ */
+static bool read_dynstr_string(int fd, const elf_soname_location &location, std::array<char, PATH_MAX> &string, bool &standalone) {
+    // The first byte of .dynstr is always a null terminator, which makes reading the byte before any string safe
+    if (!location.offset || location.length >= string.size() - 1)
+        return false;
+
+    auto readSize{static_cast<ssize_t>(location.length + 1)};
+    if (pread(fd, string.data(), static_cast<size_t>(readSize), static_cast<off_t>(location.offset - 1)) != readSize)
+        return false;
+
+    standalone = string[0] == '\0';
+    memmove(string.data(), string.data() + 1, location.length);
+    string[location.length] = '\0';
+    return true;
+}
+
+namespace {
+    /**
+     * @brief The program headers of an object loaded in the current process
+     */
+    struct LoadedObject {
+        uintptr_t bias;
+        const ElfW(Phdr) *phdrs;
+        ElfW(Half) phdrCount;
+    };
+}
 
-    // ARM64 specific function walking to locate the internal dlopen handler
-    auto loader_dlopen{[]() {
-        union BranchLinked {
-            uint32_t raw;
+/**
+ * @brief Finds a loaded object with the soname `soname` anywhere in the process
+ * @note Objects without a DT_SONAME are matched by the filename of their path, which is what the linker falls back to for them
+ * @param object Filled with the object if it was found, may be nullptr
+ * @return true if it was found
+ */
+static bool find_loaded_soname(const char *soname, LoadedObject *object) {
+    struct Search {
+        const char *soname;
+        LoadedObject *object;
+        bool found;
+    } search{soname, object, false};
 
-            struct {
-                int32_t offset : 26; //!< 26-bit branch offset
-                uint8_t sig : 6;  //!< 6-bit signature
-            };
+    dl_iterate_phdr([](dl_phdr_info *info, size_t, void *data) {
+        auto &search{*static_cast<Search *>(data)};
+        for (ElfW(Half) i{}; i < info->dlpi_phnum; i++) {
+            if (info->dlpi_phdr[i].p_type != PT_DYNAMIC)
+                continue;
 
-            bool Verify() {
-                return sig == 0x25;
+            // Bionic never relocates .dynamic in place, so DT_STRTAB is still relative to the load bias
+            ElfW(Addr) strTab{};
+            std::optional<ElfW(Xword)> sonameOffset;
+            auto dynamic{reinterpret_cast<const ElfW(Dyn) *>(info->dlpi_addr + info->dlpi_phdr[i].p_vaddr)};
+            for (auto entry{dynamic}; entry->d_tag != DT_NULL; entry++) {
+                if (entry->d_tag == DT_STRTAB)
+                    strTab = entry->d_un.d_ptr;
+                else if (entry->d_tag == DT_SONAME)
+                    sonameOffset = entry->d_un.d_val;
             }
-        };
-        static_assert(sizeof(BranchLinked) == 4, "BranchLinked is wrong size");
 
-        // Some devices ship with --X mapping for exexecutables so work around that
-        mprotect(align_ptr(reinterpret_cast<void *>(&dlopen)), getpagesize(), PROT_WRITE | PROT_READ | PROT_EXEC);
+            const char *name{info->dlpi_name};
+            if (strTab && sonameOffset)
+                name = reinterpret_cast<const char *>(info->dlpi_addr + strTab + *sonameOffset);
+            else if (name && strrchr(name, '/'))
+                name = strrchr(name, '/') + 1;
 
-        // dlopen is just a wrapper for __loader_dlopen that passes the return address as the third arg hence we can just walk it to find __loader_dlopen
-        auto blInstr{reinterpret_cast<BranchLinked *>(&dlopen)};
-        while (!blInstr->Verify())
-            blInstr++;
+            search.found = name && strcmp(name, search.soname) == 0;
+            if (search.found && search.object)
+                *search.object = {info->dlpi_addr, info->dlpi_phdr, info->dlpi_phnum};
+            return search.found ? 1 : 0;
+        }
+        return 0;
+    }, &search);
 
-        return reinterpret_cast<loader_dlopen_t>(blInstr + blInstr->offset);
-    }()};
+    return search.found;
+}
 
-    // Protect the loader_dlopen function to remove the BTI attribute (since this is an internal function that isn't intended to be jumped indirectly to)
-    mprotect(align_ptr(reinterpret_cast<void *>(&loader_dlopen)), getpagesize(), PROT_WRITE | PROT_READ | PROT_EXEC);
+/**
+ * @brief Drops everything held onto for a loaded unique instance that isn't needed to keep it loaded
+ * @note The FD of the copy is always closed. For memfd copies the pages the linker didn't map (e.g. section headers and debug info) are freed as well and with LINKERNSBYPASS_UNIQUE_SHARE_UNMODIFIED read-only segments untouched by the patch are remapped from the source library
+ */
+static void reclaim_unique_target(UniqueTarget &target, linkernsbypass_unique_stats &stats) {
+    struct stat targetStat{};
+    bool statted{fstat(target.fd, &targetStat) == 0};
+    if (statted) {
+        target.device = targetStat.st_dev;
+        target.inode = targetStat.st_ino;
+    }
 
-    // Passing dlopen as a caller address tricks the linker into using the internal unrestricted namespace letting us access libraries that are normally forbidden in the classloader namespace imposed on apps
-    auto ldHandle{loader_dlopen("ld-android.so", RTLD_LAZY, reinterpret_cast<void *>(&dlopen))};
-    if (!ldHandle)
-        return;
+    bool standalone{};
+    if (!target.sonameLocation.length || !read_dynstr_string(target.fd, target.sonameLocation, target.soname, standalone))
+        target.soname[0] = '\0';
 
-    android_link_namespaces_all_libs = reinterpret_cast<android_link_namespaces_all_libs_t>(dlsym(ldHandle, "__loader_android_link_namespaces_all_libs"));
-    if (!android_link_namespaces_all_libs)
-        return;
+    LoadedObject object{};
+    if (statted && target.memfd && target.soname[0] && find_loaded_soname(target.soname.data(), &object)) {
+        auto pageSize{static_cast<uint64_t>(getpagesize())};
+        auto pageStart{[pageSize](uint64_t value) { return value & ~(pageSize - 1); }};
+        auto pageEnd{[pageSize](uint64_t value) { return (value + pageSize - 1) & ~(pageSize - 1); }};
 
-    android_link_namespaces = reinterpret_cast<android_link_namespaces_t>(dlsym(ldHandle, "__loader_android_link_namespaces"));
-    if (!android_link_namespaces)
-        return;
+        // Remapping text from the source would undo the huge page mappings
+        bool shareUnmodified{target.sourceFd != -1 && !target.hugePageLayout.load_size};
 
-    auto libdlAndroidHandle{loader_dlopen("libdl_android.so", RTLD_LAZY, reinterpret_cast<void *>(&dlopen))};
-    if (!libdlAndroidHandle)
-        return;
+        std::vector<std::pair<uint64_t, uint64_t>> mappedPages; //!< The [start, end) file offsets of every page still mapped from the copy
+        for (ElfW(Half) i{}; i < object.phdrCount; i++) {
+            auto &pHdr{object.phdrs[i]};
+            if (pHdr.p_type != PT_LOAD || !pHdr.p_filesz)
+                continue;
 
-    loader_android_create_namespace = reinterpret_cast<loader_android_create_namespace_t>(dlsym(libdlAndroidHandle, "__loader_android_create_namespace"));
-    if (!loader_android_create_namespace)
-        return;
+            uint64_t fileStart{pageStart(pHdr.p_offset)}, fileEnd{pageEnd(pHdr.p_offset + pHdr.p_filesz)};
 
-    android_get_exported_namespace = reinterpret_cast<android_get_exported_namespace_t>(dlsym(libdlAndroidHandle, "__loader_android_get_exported_namespace"));
-    if (!android_get_exported_namespace)
-        return;
+            // Writable segments may have pages that were never copied on write and are still backed by the copy, as are pages holding the soname or a rewritten DT_NEEDED string
+            auto overlaps{[fileStart, fileEnd](const elf_soname_location &location) { return location.offset < fileEnd && location.offset + location.length > fileStart; }};
+            bool patched{overlaps(target.sonameLocation) || std::any_of(target.rewriteLocations.begin(), target.rewriteLocations.end(), overlaps)};
+            if (shareUnmodified && !(pHdr.p_flags & PF_W) && !patched) {
+                auto address{reinterpret_cast<void *>(pageStart(object.bias + pHdr.p_vaddr))};
+                int prot{get_mapping_protection(reinterpret_cast<uintptr_t>(address))};
+                if (prot != -1 && mmap(address, fileEnd - fileStart, prot, MAP_PRIVATE | MAP_FIXED, target.sourceFd, static_cast<off_t>(fileStart)) != MAP_FAILED)
+                    continue;
+            }
+
+            mappedPages.emplace_back(fileStart, fileEnd);
+        }
+
+        // Free every page of the copy that nothing maps anymore, shmem pages are otherwise kept for as long as any part of the file is mapped
+        std::sort(mappedPages.begin(), mappedPages.end());
+        mappedPages.emplace_back(pageEnd(static_cast<uint64_t>(targetStat.st_size)), UINT64_MAX);
+
+        // Punching part of a shmem huge page splits it, so with huge pages only holes covering whole ones are punched
+        uint64_t holeAlignment{target.hugePageLayout.load_size ? HugePageSize : pageSize};
+        uint64_t offset{};
+        for (auto &[start, end] : mappedPages) {
+            uint64_t holeStart{(offset + holeAlignment - 1) & ~(holeAlignment - 1)}, holeEnd{start & ~(holeAlignment - 1)};
+            if (holeEnd > holeStart && fallocate(target.fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, static_cast<off_t>(holeStart), static_cast<off_t>(holeEnd - holeStart)) == 0)
+                stats.bytes_reclaimed += holeEnd - holeStart;
+            offset = std::max(offset, end);
+        }
+    }
+
+    close(target.fd);
+    target.fd = -1;
+
+    if (target.sourceFd != -1) {
+        close(target.sourceFd);
+        target.sourceFd = -1;
+    }
+}
+
+/**
+ * @brief Loads a soname patched copy created by prepare_unique_target into `ns`
+ */
+static void *load_unique_target(int libTargetFd, int flags, android_namespace_t *ns, const android_dlextinfo *extInfo, linkernsbypass_unique_stats &stats) {
+    FaultCounter faultCounter{stats};
+
+    // Load our patched library into the hook namespace, keeping any extra options (e.g. RELRO sharing) the caller asked for
+    android_dlextinfo hookExtInfo{extInfo ? *extInfo : android_dlextinfo{}};
+    hookExtInfo.flags |= ANDROID_DLEXT_USE_NAMESPACE | ANDROID_DLEXT_USE_LIBRARY_FD;
+    hookExtInfo.flags &= ~static_cast<uint64_t>(ANDROID_DLEXT_USE_LIBRARY_FD_OFFSET);
+    hookExtInfo.library_fd = libTargetFd;
+    hookExtInfo.library_namespace = ns;
+
+    // Make a path that looks about right
+    std::array<char, PATH_MAX> pathBuf{};
+    snprintf(pathBuf.data(), pathBuf.size(), "/proc/self/fd/%d", libTargetFd);
+
+    TraceSection trace{"android_dlopen_ext"};
+    auto dlopenStart{get_time_ns()};
+    auto handle{android_dlopen_ext(pathBuf.data(), flags, &hookExtInfo)};
+    stats.dlopen_ns += get_time_ns() - dlopenStart;
+
+    return handle;
+}
+
+void *linkernsbypass_namespace_dlopen_unique(const char *libPath, const char *libTargetDir, int flags, android_namespace_t *ns) {
+    linkernsbypass_unique_info info{};
+    info.target_dir = libTargetDir;
+
+    return linkernsbypass_namespace_dlopen_unique_ext(libPath, flags, ns, &info);
+}
+
+/**
+ * @brief Loads a prepared unique target, into a slot of `info->arena` if set, releasing it if loading fails
+ * @param info The options the target was prepared with, may be nullptr
+ */
+static void *load_unique_target(UniqueTarget &target, int flags, android_namespace_t *ns, const linkernsbypass_unique_info *info, linkernsbypass_unique_stats &stats) {
+    if (target.fd == -1)
+        return nullptr;
+
+    const android_dlextinfo *extInfo{info ? info->extinfo : nullptr};
+    android_dlextinfo reservedExtInfo{};
+    if (info && info->arena) {
+        auto slot{allocate_arena_slot(info->arena)};
+        if (!slot) {
+            event_log_failure(LINKERNSBYPASS_EVENT_CALL_ALLOCATE_ID, nullptr, ENOSPC);
+            release_unique_target(target);
+            return nullptr;
+        }
+
+        target.arena = info->arena;
+        target.arenaSlot = *slot;
+
+        reservedExtInfo = extInfo ? *extInfo : android_dlextinfo{};
+        reservedExtInfo.flags &= ~static_cast<uint64_t>(ANDROID_DLEXT_RESERVED_ADDRESS | ANDROID_DLEXT_RESERVED_ADDRESS_HINT);
+        reservedExtInfo.flags |= (info->flags & LINKERNSBYPASS_UNIQUE_ARENA_HINT) ? ANDROID_DLEXT_RESERVED_ADDRESS_HINT : ANDROID_DLEXT_RESERVED_ADDRESS;
+        reservedExtInfo.reserved_addr = target.arena->base + target.arenaSlot * target.arena->slotSize;
+        reservedExtInfo.reserved_size = target.arena->slotSize;
+        extInfo = &reservedExtInfo;
+    } else if (auto &layout{target.hugePageLayout}; layout.load_size && !(extInfo && (extInfo->flags & (ANDROID_DLEXT_RESERVED_ADDRESS | ANDROID_DLEXT_RESERVED_ADDRESS_HINT)))) {
+        // Place the executable segment so that its file offset and address agree modulo the huge page size, otherwise the kernel can never map it with huge pages
+        target.reservation = reserve_aligned_address_space(layout.load_size, HugePageSize, (layout.text_offset - layout.text_vaddr) & (HugePageSize - 1));
+        if (target.reservation) {
+            reservedExtInfo = extInfo ? *extInfo : android_dlextinfo{};
+            reservedExtInfo.flags |= ANDROID_DLEXT_RESERVED_ADDRESS;
+            reservedExtInfo.reserved_addr = target.reservation;
+            reservedExtInfo.reserved_size = layout.load_size;
+            extInfo = &reservedExtInfo;
+        }
+    }
+
+    auto handle{load_unique_target(target.fd, flags, ns, extInfo, stats)};
+    if (!handle) {
+        release_unique_target(target);
+        return nullptr;
+    }
+
+    // The copy is already backed by huge pages, but the text mapping also needs the hint before its PMDs will be mapped as huge pages on fault
+    if (target.hugePageLayout.load_size && extInfo && (extInfo->flags & ANDROID_DLEXT_RESERVED_ADDRESS)) {
+        auto &layout{target.hugePageLayout};
+        auto textStart{reinterpret_cast<uintptr_t>(extInfo->reserved_addr) + layout.text_vaddr};
+        auto hugeStart{(textStart + HugePageSize - 1) & ~(HugePageSize - 1)};
+        auto hugeEnd{(textStart + layout.text_size) & ~(HugePageSize - 1)};
+        if (hugeStart < hugeEnd)
+            madvise(reinterpret_cast<void *>(hugeStart), hugeEnd - hugeStart, MADV_HUGEPAGE);
+    }
+
+    reclaim_unique_target(target, stats);
+    return handle;
+}
+
+/**
+ * @return How the copy of a unique instance was made, for the load event log
+ */
+static uint32_t get_event_target(const UniqueTarget &target, const linkernsbypass_unique_stats &stats) {
+    if (stats.prepatched_loads)
+        return LINKERNSBYPASS_EVENT_TARGET_PREPATCHED;
+    else if (stats.prewarm_hits)
+        return LINKERNSBYPASS_EVENT_TARGET_PREWARMED;
+    else if (stats.cache_hits)
+        return LINKERNSBYPASS_EVENT_TARGET_CACHE;
+    else if (stats.file_targets)
+        return LINKERNSBYPASS_EVENT_TARGET_FILE;
+    else if (stats.memfd_targets || target.memfd)
+        return LINKERNSBYPASS_EVENT_TARGET_MEMFD;
+    else
+        return LINKERNSBYPASS_EVENT_TARGET_NONE;
+}
+
+/**
+ * @brief Loads a prepared unique target of `libPath` like load_unique_target, recording the load in the event log
+ * @note The duration covers every stage in `stats`, so it includes preparing the target as well
+ */
+static void *load_unique_target(const char *libPath, UniqueTarget &target, int flags, android_namespace_t *ns, const linkernsbypass_unique_info *info, linkernsbypass_unique_stats &stats) {
+    // The target is reset if loading fails
+    auto id{target.id};
+    auto eventTarget{get_event_target(target, stats)};
+
+    auto handle{load_unique_target(target, flags, ns, info, stats)};
+    linkernsbypass_event event{};
+    event.duration_ns = stats.parse_ns + stats.target_create_ns + stats.copy_ns + stats.patch_ns + stats.dlopen_ns;
+    event.ns = ns;
+    event.handle = handle;
+    event.unique_id = id ? static_cast<int64_t>(*id) : -1;
+    event.type = LINKERNSBYPASS_EVENT_UNIQUE_LOAD;
+    event.target = eventTarget;
+    event_log_record(event, libPath);
+    return handle;
+}
+
+struct linkernsbypass_unique_t {
+    std::atomic<uint32_t> refCount{1};
+    void *handle; //!< The handle returned by the linker
+    UniqueTarget target;
+    std::vector<linkernsbypass_unique_t *> dependencies; //!< Instances of the libraries in the DT_NEEDED closure in the order they were loaded, these are unloaded after this instance
+};
+
+/**
+ * @brief Runs `function` for every index below `count` across a handful of threads, including the calling one
+ */
+template<typename Function>
+static void patch_in_parallel(size_t count, Function &&function) {
+    // Patching is almost entirely I/O bound so a handful of workers is enough to keep the storage busy
+    constexpr size_t MaxWorkers{4};
+
+    std::atomic<size_t> next{};
+    auto patchWorker{[&]() {
+        for (size_t i{next++}; i < count; i = next++)
+            function(i);
+    }};
+
+    std::vector<std::thread> workers;
+    size_t workerCount{std::min<size_t>({count, MaxWorkers, std::max(std::thread::hardware_concurrency(), 1U)})};
+    for (size_t i{1}; i < workerCount; i++)
+        workers.emplace_back(patchWorker);
+
+    // The calling thread takes part in patching rather than sitting idle
+    patchWorker();
+
+    for (auto &worker : workers)
+        worker.join();
+}
+
+namespace {
+    /**
+     * @brief A library in the DT_NEEDED closure of a recursive unique load
+     */
+    struct ClosureNode {
+        std::array<char, PATH_MAX> path{};
+        std::array<char, PATH_MAX> soname{};
+        int fd{-1};
+        elf_soname_location location{}; //!< The location of the soname
+        std::vector<std::pair<size_t, elf_soname_location>> needed; //!< The index of each node this library depends on, along with the location of the DT_NEEDED string that refers to it
+        SonamePatch sonamePatch{};
+        bool ownsId{}; //!< If the ID of `target` is allocated and hasn't been handed over to an instance yet
+        UniqueTarget target{};
+        linkernsbypass_unique_stats stats{};
+    };
+}
+
+/**
+ * @brief Opens `path` and adds it to `nodes`
+ * @param expectedSoname The soname the library must have, may be nullptr
+ * @return false if the library couldn't be read or has a different soname
+ */
+static bool add_closure_node(std::vector<ClosureNode> &nodes, const char *path, const char *expectedSoname) {
+    ClosureNode node{};
+    snprintf(node.path.data(), node.path.size(), "%s", path);
+    node.fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (node.fd == -1)
+        return false;
+
+    bool standalone{};
+    if (!elf_soname_locate(node.fd, &node.location) || !read_dynstr_string(node.fd, node.location, node.soname, standalone) ||
+        (expectedSoname && strcmp(node.soname.data(), expectedSoname) != 0)) {
+        close(node.fd);
+        return false;
+    }
+
+    nodes.push_back(std::move(node));
+    return true;
+}
+
+/**
+ * @brief Fills in the dependencies of every node on the other nodes from their DT_NEEDED entries, which are matched by soname
+ * @param libDir If non-null, dependencies that aren't a node yet are looked for in this directory and added as nodes, otherwise they're left for the linker to resolve as usual
+ * @return false if a library couldn't be read or has a dependency on a node that can't be rewritten
+ */
+static bool link_closure_nodes(std::vector<ClosureNode> &nodes, const char *libDir) {
+    std::vector<elf_soname_location> needed;
+    for (size_t i{}; i < nodes.size(); i++) {
+        size_t count{};
+        if (!elf_needed_locate(nodes[i].fd, nullptr, &count))
+            return false;
+
+        needed.resize(count);
+        if (!elf_needed_locate(nodes[i].fd, needed.data(), &count))
+            return false;
+
+        for (auto &location : needed) {
+            std::array<char, PATH_MAX> name{};
+            bool standalone{};
+            if (!read_dynstr_string(nodes[i].fd, location, name, standalone))
+                return false;
+            else if (strchr(name.data(), '/'))
+                continue;
+
+            auto index{static_cast<size_t>(std::find_if(nodes.begin(), nodes.end(), [&name](const ClosureNode &node) { return strcmp(node.soname.data(), name.data()) == 0; }) - nodes.begin())};
+            if (index == nodes.size()) {
+                if (!libDir)
+                    continue;
+
+                std::array<char, PATH_MAX> path{};
+                snprintf(path.data(), path.size(), "%s/%s", libDir, name.data());
+                if (!add_closure_node(nodes, path.data(), name.data()))
+                    continue;
+            }
+
+            // Rewriting a string that another one was merged into would corrupt the other string
+            if (!standalone)
+                return false;
+
+            nodes[i].needed.emplace_back(index, location);
+        }
+    }
+
+    return true;
+}
+
+/**
+ * @brief Finds every library in the DT_NEEDED closure of `libPath` that lives in the same directory as it, `libPath` itself is always the first node
+ * @note Dependencies are matched by soname, anything that can't be found in the directory is left for the linker to resolve as usual
+ * @return false if the closure couldn't be read or has a dependency that can't be rewritten
+ */
+static bool find_unique_closure(const char *libPath, std::vector<ClosureNode> &nodes) {
+    if (!add_closure_node(nodes, libPath, nullptr))
+        return false;
+
+    std::array<char, PATH_MAX> libDir{};
+    auto separator{strrchr(libPath, '/')};
+    snprintf(libDir.data(), libDir.size(), "%.*s", separator ? static_cast<int>(separator - libPath) : 1, separator ? libPath : ".");
+
+    return link_closure_nodes(nodes, libDir.data());
+}
+
+/**
+ * @brief Orders the nodes so every library comes after its dependencies, otherwise keeping them in order, which leaves `libPath` last for a closure
+ * @return false if the nodes have a cycle, as a cycle can't be loaded one library at a time
+ */
+static bool sort_unique_closure(const std::vector<ClosureNode> &nodes, std::vector<size_t> &order) {
+    enum class State : uint8_t { Unvisited, Visiting, Visited };
+    std::vector<State> states(nodes.size());
+
+    auto visit{[&](auto &self, size_t index) -> bool {
+        if (states[index] != State::Unvisited)
+            return states[index] == State::Visited;
+
+        states[index] = State::Visiting;
+        for (auto &needed : nodes[index].needed)
+            if (!self(self, needed.first))
+                return false;
+
+        states[index] = State::Visited;
+        order.push_back(index);
+        return true;
+    }};
+
+    for (size_t i{}; i < nodes.size(); i++)
+        if (!visit(visit, i))
+            return false;
+
+    return true;
+}
+
+/**
+ * @brief Loads a unique instance of `libPath` along with unique instances of its DT_NEEDED closure, for LINKERNSBYPASS_UNIQUE_RECURSIVE
+ * @param target Filled with the patched copy of `libPath`
+ * @param dependencies Filled with the instances of the dependencies in the order they were loaded
+ * @return The handle of `libPath`, or nullptr on failure in which case nothing is left loaded
+ */
+static void *load_unique_closure(const char *libPath, int flags, android_namespace_t *ns, const linkernsbypass_unique_info *info, UniqueTarget &target, std::vector<linkernsbypass_unique_t *> &dependencies) {
+    TraceSection trace{"linkernsbypass_load_unique_closure"};
+
+    // The cache has no way to key copies on the IDs of their dependencies
+    linkernsbypass_unique_info closureInfo{*info};
+    closureInfo.flags &= ~static_cast<uint64_t>(LINKERNSBYPASS_UNIQUE_PERSISTENT_CACHE);
+
+    std::vector<ClosureNode> nodes;
+    std::vector<size_t> order;
+    auto parseStart{get_time_ns()};
+    bool prepared{find_unique_closure(libPath, nodes) && sort_unique_closure(nodes, order)};
+    if (!nodes.empty())
+        nodes.front().stats.parse_ns += get_time_ns() - parseStart;
+
+    // Every ID has to be known before patching starts since copies are patched with the IDs of their dependencies
+    for (auto &node : nodes) {
+        auto id{prepared ? allocate_unique_id(node.location, info->id_width, node.sonamePatch) : std::nullopt};
+        prepared = id.has_value();
+        node.ownsId = prepared;
+        node.target.id = id;
+    }
+
+    if (prepared) {
+        patch_in_parallel(nodes.size(), [&](size_t i) {
+            auto &node{nodes[i]};
+            FaultCounter faultCounter{node.stats};
+            node.stats.loads++;
+
+            std::vector<DynstrRewrite> rewrites;
+            for (auto &[dependency, location] : node.needed)
+                rewrites.push_back({location, nodes[dependency].sonamePatch.data()});
+
+            create_unique_target(node.path.data(), node.fd, node.location, node.sonamePatch.data(), rewrites, &closureInfo, node.target, node.stats);
+        });
+    }
+
+    for (auto &node : nodes)
+        close(node.fd);
+
+    void *handle{};
+    for (size_t i{}; prepared && i < order.size(); i++) {
+        auto &node{nodes[order[i]]};
+        if (node.target.fd == -1)
+            break;
+
+        // The target is released by load_unique_target on failure, so either way it's no longer owned by the node
+        node.ownsId = false;
+        bool isRoot{order[i] == 0};
+        auto nodeHandle{load_unique_target(node.path.data(), node.target, isRoot ? flags : flags & ~RTLD_GLOBAL, ns, &closureInfo, node.stats)};
+        if (!nodeHandle)
+            break;
+
+        if (isRoot) {
+            handle = nodeHandle;
+            target = node.target;
+        } else {
+            auto dependency{new linkernsbypass_unique_t{}};
+            dependency->handle = nodeHandle;
+            dependency->target = node.target;
+            dependencies.push_back(dependency);
+        }
+    }
+
+    if (!handle) {
+        for (auto dependency{dependencies.rbegin()}; dependency != dependencies.rend(); dependency++)
+            linkernsbypass_unique_unload(*dependency);
+        dependencies.clear();
+    }
+
+    for (auto &node : nodes) {
+        if (node.ownsId)
+            release_unique_target(node.target);
+
+        record_unique_stats(node.stats, info);
+    }
+
+    return handle;
+}
+
+static std::mutex directLoadsMutex;
+static std::vector<std::string> directLoads; //!< The sonames of libraries loaded without a copy, these can't go through the fast path again as they may still be loaded
+
+/**
+ * @brief Checks if `libPath` can be loaded as a new instance without patching a copy of it, for LINKERNSBYPASS_UNIQUE_IF_NEEDED
+ * @note The soname is claimed on success so concurrent and later loads of the same library still get their own copy, even before the first one has been loaded
+ * @param soname Set to the claimed soname on success, for unclaim_direct_load
+ */
+static bool claim_direct_load(const char *libPath, linkernsbypass_unique_stats &stats, std::string &soname) {
+    auto parseStart{get_time_ns()};
+    int libFd{open(libPath, O_RDONLY | O_CLOEXEC)};
+    if (libFd == -1)
+        return false;
+
+    elf_soname_location location{};
+    std::array<char, PATH_MAX> name{};
+    bool standalone{};
+    bool located{elf_soname_locate(libFd, &location) && read_dynstr_string(libFd, location, name, standalone)};
+    close(libFd);
+    stats.parse_ns += get_time_ns() - parseStart;
+
+    if (!located)
+        return false;
+
+    std::scoped_lock lock{directLoadsMutex};
+    if (std::find(directLoads.begin(), directLoads.end(), name.data()) != directLoads.end() || find_loaded_soname(name.data(), nullptr))
+        return false;
+
+    soname = name.data();
+    directLoads.push_back(soname);
+    return true;
+}
+
+/**
+ * @brief Releases a soname claimed by claim_direct_load after the library failed to load, so it can go through the fast path again
+ */
+static void unclaim_direct_load(const std::string &soname) {
+    std::scoped_lock lock{directLoadsMutex};
+    auto claim{std::find(directLoads.begin(), directLoads.end(), soname)};
+    if (claim != directLoads.end())
+        directLoads.erase(claim);
+}
+
+/**
+ * @brief Loads `libPath` without a copy if LINKERNSBYPASS_UNIQUE_IF_NEEDED is set and it isn't loaded yet
+ * @param handle Set to the handle of the loaded library
+ * @return If the library was loaded through the fast path, otherwise (including when loading it directly failed) a unique copy needs to be loaded instead
+ */
+static bool load_direct_if_possible(const char *libPath, int flags, android_namespace_t *ns, const linkernsbypass_unique_info *info, void *&handle) {
+    if (!(info->flags & LINKERNSBYPASS_UNIQUE_IF_NEEDED))
+        return false;
+
+    linkernsbypass_unique_stats stats{};
+    std::string soname;
+    bool direct{claim_direct_load(libPath, stats, soname)};
+    if (direct) {
+        TraceSection trace{"android_dlopen_ext"};
+        auto dlopenStart{get_time_ns()};
+        handle = linkernsbypass_namespace_dlopen_ext(libPath, flags, ns, info->extinfo);
+        stats.dlopen_ns += get_time_ns() - dlopenStart;
+
+        direct = handle != nullptr;
+        if (direct) {
+            stats.loads++;
+            stats.direct_loads++;
+        } else {
+            unclaim_direct_load(soname);
+        }
+        linkernsbypass_event event{};
+        event.duration_ns = stats.parse_ns + stats.dlopen_ns;
+        event.ns = ns;
+        event.handle = handle;
+        event.unique_id = -1;
+        event.type = LINKERNSBYPASS_EVENT_UNIQUE_LOAD;
+        event.target = LINKERNSBYPASS_EVENT_TARGET_DIRECT;
+        event_log_record(event, libPath);
+    }
+
+    record_unique_stats(stats, info);
+    return direct;
+}
+
+void *linkernsbypass_namespace_dlopen_unique_ext(const char *libPath, int flags, android_namespace_t *ns, const linkernsbypass_unique_info *info) {
+    if (void *handle{}; load_direct_if_possible(libPath, flags, ns, info, handle))
+        return handle;
+
+    if (info->flags & LINKERNSBYPASS_UNIQUE_RECURSIVE) {
+        UniqueTarget target{};
+        std::vector<linkernsbypass_unique_t *> dependencies;
+        auto handle{load_unique_closure(libPath, flags, ns, info, target, dependencies)};
+
+        // Like the instance itself the dependencies are never unloaded, so only the bookkeeping for them needs to go
+        for (auto dependency : dependencies)
+            delete dependency;
+
+        return handle;
+    }
+
+    linkernsbypass_unique_stats stats{};
+    auto target{prepare_unique_target(libPath, info, stats)};
+    auto handle{load_unique_target(libPath, target, flags, ns, info, stats)};
+
+    record_unique_stats(stats, info);
+    return handle;
+}
+
+linkernsbypass_unique_t *linkernsbypass_namespace_dlopen_unique_handle(const char *libPath, int flags, android_namespace_t *ns, const linkernsbypass_unique_info *info) {
+    if (void *handle{}; load_direct_if_possible(libPath, flags, ns, info, handle)) {
+        auto unique{new linkernsbypass_unique_t{}};
+        unique->handle = handle;
+        return unique;
+    }
+
+    if (info->flags & LINKERNSBYPASS_UNIQUE_RECURSIVE) {
+        auto unique{new linkernsbypass_unique_t{}};
+        unique->handle = load_unique_closure(libPath, flags, ns, info, unique->target, unique->dependencies);
+        if (!unique->handle) {
+            delete unique;
+            return nullptr;
+        }
+
+        return unique;
+    }
+
+    linkernsbypass_unique_stats stats{};
+    auto target{prepare_unique_target(libPath, info, stats)};
+    auto handle{load_unique_target(libPath, target, flags, ns, info, stats)};
+
+    record_unique_stats(stats, info);
+    if (!handle)
+        return nullptr;
+
+    auto unique{new linkernsbypass_unique_t{}};
+    unique->handle = handle;
+    unique->target = target;
+    return unique;
+}
+
+static std::mutex prepatchedLoadsMutex;
+static std::vector<std::string> prepatchedLoads; //!< The sonames of pre-patched variants that are being loaded, once loaded they're found through find_loaded_soname instead
+
+/**
+ * @brief Opens the first variant of `libName` in `bundleDir` that isn't already loaded and claims its soname until it has been loaded
+ * @param soname Set to the soname of the variant, this must be passed to release_prepatched_variant once it's been loaded
+ * @param location Set to the location of the soname in the variant
+ * @return An FD of the variant, or -1 if every variant is in use
+ */
+static int claim_prepatched_variant(const char *bundleDir, const char *libName, std::array<char, PATH_MAX> &soname, elf_soname_location &location, linkernsbypass_unique_stats &stats) {
+    for (unsigned long variant{};; variant++) {
+        std::array<char, PATH_MAX> path{};
+        snprintf(path.data(), path.size(), "%s/%lu/%s", bundleDir, variant, libName);
+
+        auto parseStart{get_time_ns()};
+        int fd{open(path.data(), O_RDONLY | O_CLOEXEC)};
+        if (fd == -1)
+            return -1; // Variants are numbered contiguously, so this is the end of the bundle
+
+        bool standalone{};
+        bool located{elf_soname_locate(fd, &location) && read_dynstr_string(fd, location, soname, standalone)};
+        stats.parse_ns += get_time_ns() - parseStart;
+
+        if (located) {
+            std::scoped_lock lock{prepatchedLoadsMutex};
+            if (std::find(prepatchedLoads.begin(), prepatchedLoads.end(), soname.data()) == prepatchedLoads.end() && !find_loaded_soname(soname.data(), nullptr)) {
+                prepatchedLoads.emplace_back(soname.data());
+                return fd;
+            }
+        }
+
+        close(fd);
+    }
+}
+
+static void release_prepatched_variant(const std::array<char, PATH_MAX> &soname) {
+    std::scoped_lock lock{prepatchedLoadsMutex};
+    prepatchedLoads.erase(std::find(prepatchedLoads.begin(), prepatchedLoads.end(), soname.data()));
+}
+
+linkernsbypass_unique_t *linkernsbypass_namespace_dlopen_prepatched(const char *bundleDir, const char *libName, int flags, android_namespace_t *ns, const linkernsbypass_unique_info *info) {
+    TraceSection trace{"linkernsbypass_namespace_dlopen_prepatched"};
+
+    linkernsbypass_unique_stats stats{};
+    std::array<char, PATH_MAX> soname{};
+    UniqueTarget target{};
+    target.fd = claim_prepatched_variant(bundleDir, libName, soname, target.sonameLocation, stats);
+    if (target.fd == -1) {
+        record_unique_stats(stats, info);
+        return nullptr;
+    }
+
+    stats.loads++;
+    stats.prepatched_loads++;
+
+    // The variant is loaded straight from its file, so its pages stay clean and backed by it
+    auto handle{load_unique_target(libName, target, flags, ns, info, stats)};
+    release_prepatched_variant(soname);
+
+    record_unique_stats(stats, info);
+    if (!handle)
+        return nullptr;
+
+    auto unique{new linkernsbypass_unique_t{}};
+    unique->handle = handle;
+    unique->target = target;
+    return unique;
+}
+
+void *linkernsbypass_unique_get_handle(linkernsbypass_unique_t *unique) {
+    return unique->handle;
+}
+
+linkernsbypass_unique_t *linkernsbypass_unique_retain(linkernsbypass_unique_t *unique) {
+    unique->refCount.fetch_add(1, std::memory_order_relaxed);
+    return unique;
+}
+
+bool linkernsbypass_unique_unload(linkernsbypass_unique_t *unique) {
+    if (!unique || unique->refCount.fetch_sub(1, std::memory_order_acq_rel) != 1)
+        return true;
+
+    auto closeStart{get_time_ns()};
+    bool closed{dlclose(unique->handle) == 0};
+
+    // dlclose also succeeds when the linker keeps the library around, e.g. for DF_1_NODELETE or while a thread_local destructor still references it
+    if (closed && unique->target.soname[0] && find_loaded_soname(unique->target.soname.data(), nullptr))
+        closed = false;
+
+    linkernsbypass_event event{};
+    event.duration_ns = get_time_ns() - closeStart;
+    event.handle = unique->handle;
+    event.unique_id = unique->target.id ? static_cast<int64_t>(*unique->target.id) : -1;
+    event.type = LINKERNSBYPASS_EVENT_UNIQUE_UNLOAD;
+    event.error = closed ? 0 : -1;
+    event_log_record(event, nullptr);
+
+    if (closed) {
+        release_unique_target(unique->target);
+
+        // Dependencies can only go once nothing that needs them is left
+        for (auto dependency{unique->dependencies.rbegin()}; dependency != unique->dependencies.rend(); dependency++)
+            closed = linkernsbypass_unique_unload(*dependency) && closed;
+    } else {
+        // If the linker kept the instance around then its ID can't be handed out again without the soname colliding and its address space (arena slot or huge page reservation) is still occupied, so only drop the copy
+        // Its dependencies are still needed by it so they're left loaded too
+        if (unique->target.fd != -1)
+            close(unique->target.fd);
+        if (unique->target.sourceFd != -1)
+            close(unique->target.sourceFd);
+        if (unique->target.path[0])
+            unlink(unique->target.path.data());
+    }
+
+    delete unique;
+    return closed;
+}
+
+bool linkernsbypass_unique_get_memory_usage(linkernsbypass_unique_t *unique, linkernsbypass_unique_memory_usage *usage) {
+    if (!unique || !usage || !unique->target.inode)
+        return false;
+
+    FILE *smaps{fopen("/proc/self/smaps", "re")};
+    if (!smaps)
+        return false;
+
+    *usage = {};
+    bool inMapping{};
+    uint64_t rss{};
+    std::array<char, 512> line{};
+    while (fgets(line.data(), line.size(), smaps)) {
+        uintptr_t start{}, end{};
+        std::array<char, 5> perms{};
+        unsigned long long offset{};
+        unsigned int major{}, minor{};
+        unsigned long inode{};
+        if (sscanf(line.data(), "%" SCNxPTR "-%" SCNxPTR " %4s %llx %x:%x %lu", &start, &end, perms.data(), &offset, &major, &minor, &inode) == 7) {
+            inMapping = inode == unique->target.inode && makedev(major, minor) == unique->target.device;
+            rss = 0;
+        } else if (inMapping) {
+            uint64_t kilobytes{};
+            if (sscanf(line.data(), "Rss: %" SCNu64 " kB", &kilobytes) == 1) {
+                rss = kilobytes * 1024;
+            } else if (sscanf(line.data(), "Anonymous: %" SCNu64 " kB", &kilobytes) == 1) {
+                // Anonymous pages are the ones that were copied on write, everything else is still backed by the file
+                usage->private_bytes += kilobytes * 1024;
+                usage->shared_bytes += rss - std::min(rss, kilobytes * 1024);
+            }
+        }
+    }
+
+    fclose(smaps);
+    return true;
+}
+
+int linkernsbypass_create_shared_unique_fd(const char *libPath, const linkernsbypass_unique_info *info) {
+    // Source segments can't be remapped into the copy as it's never loaded here, so there'd be nothing to close the duplicated source FD
+    linkernsbypass_unique_info sharedInfo{info ? *info : linkernsbypass_unique_info{}};
+    sharedInfo.flags = (sharedInfo.flags & ~(LINKERNSBYPASS_UNIQUE_PERSISTENT_CACHE | LINKERNSBYPASS_UNIQUE_SHARE_UNMODIFIED)) | LINKERNSBYPASS_UNIQUE_SEALED;
+    sharedInfo.target_dir = nullptr;
+
+    // Prewarmed copies can't be used as they have plain IDs that the receiving process could also allocate
+    linkernsbypass_unique_stats stats{};
+    auto target{prepare_new_unique_target(libPath, &sharedInfo, stats, SharedIdMarker)};
+    record_unique_stats(stats, info);
+
+    // The ID is intentionally never released, there is no way to tell when every process that the memfd was shared with is done with it
+    return target.fd;
+}
+
+bool linkernsbypass_send_fd(int socketFd, int fd) {
+    char data{};
+    iovec iov{};
+    iov.iov_base = &data;
+    iov.iov_len = sizeof(data);
+
+    alignas(cmsghdr) std::array<char, CMSG_SPACE(sizeof(int))> control{};
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.data();
+    msg.msg_controllen = control.size();
+
+    auto cmsg{CMSG_FIRSTHDR(&msg)};
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    ssize_t ret;
+    do {
+        ret = sendmsg(socketFd, &msg, MSG_NOSIGNAL);
+    } while (ret == -1 && errno == EINTR);
+
+    return ret == sizeof(data);
+}
+
+int linkernsbypass_receive_fd(int socketFd) {
+    char data{};
+    iovec iov{};
+    iov.iov_base = &data;
+    iov.iov_len = sizeof(data);
+
+    alignas(cmsghdr) std::array<char, CMSG_SPACE(sizeof(int))> control{};
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.data();
+    msg.msg_controllen = control.size();
+
+    ssize_t ret;
+    do {
+        ret = recvmsg(socketFd, &msg, MSG_CMSG_CLOEXEC);
+    } while (ret == -1 && errno == EINTR);
+
+    if (ret != sizeof(data))
+        return -1;
+
+    auto cmsg{CMSG_FIRSTHDR(&msg)};
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(int)))
+        return -1;
+
+    int fd;
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    return fd;
+}
+
+void *linkernsbypass_namespace_dlopen_shared_fd(int fd, int flags, android_namespace_t *ns, const android_dlextinfo *extInfo) {
+    // Refuse anything that the sender could still modify underneath us
+    constexpr int RequiredSeals{F_SEAL_WRITE | F_SEAL_SHRINK};
+    int seals{fcntl(fd, F_GET_SEALS)};
+    if (seals == -1 || (seals & RequiredSeals) != RequiredSeals)
+        return nullptr;
+
+    linkernsbypass_unique_stats stats{};
+    return load_unique_target(fd, flags, ns, extInfo, stats);
+}
+
+bool linkernsbypass_namespace_dlopen_unique_batch(const linkernsbypass_unique_request *requests, size_t count, android_namespace_t *ns, const linkernsbypass_unique_info *info, void **handles) {
+    TraceSection trace{"linkernsbypass_namespace_dlopen_unique_batch"};
+    std::fill(handles, handles + count, nullptr);
+
+    // Batch libraries are only matched against each other, so there's a node for every request in the same order
+    std::vector<ClosureNode> nodes;
+    std::vector<size_t> order;
+    auto parseStart{get_time_ns()};
+    bool prepared{true};
+    for (size_t i{}; prepared && i < count; i++)
+        prepared = add_closure_node(nodes, requests[i].lib_path, nullptr);
+    prepared = prepared && link_closure_nodes(nodes, nullptr) && sort_unique_closure(nodes, order);
+    if (!nodes.empty())
+        nodes.front().stats.parse_ns += get_time_ns() - parseStart;
+
+    std::vector<bool> dependedOn(nodes.size());
+    for (auto &node : nodes)
+        for (auto &needed : node.needed)
+            dependedOn[needed.first] = true;
+
+    // Copies are patched with the IDs of the batch libraries they depend on, so those have to be known before patching starts
+    for (size_t i{}; prepared && i < nodes.size(); i++) {
+        auto &node{nodes[i]};
+        if (!dependedOn[i] && node.needed.empty())
+            continue;
+
+        node.target.id = allocate_unique_id(node.location, info->id_width, node.sonamePatch);
+        prepared = node.target.id.has_value();
+    }
+
+    // The cache has no way to key copies on the IDs of their dependencies
+    linkernsbypass_unique_info rewriteInfo{*info};
+    rewriteInfo.flags &= ~static_cast<uint64_t>(LINKERNSBYPASS_UNIQUE_PERSISTENT_CACHE);
+
+    if (prepared) {
+        patch_in_parallel(nodes.size(), [&](size_t i) {
+            auto &node{nodes[i]};
+
+            // Libraries unrelated to the rest of the batch are created like any other unique load, which lets them come from the prewarmed pool
+            if (!node.target.id) {
+                node.target = prepare_unique_target(node.path.data(), info, node.stats);
+                return;
+            }
+
+            FaultCounter faultCounter{node.stats};
+            node.stats.loads++;
+
+            std::vector<DynstrRewrite> rewrites;
+            for (auto &[dependency, location] : node.needed)
+                rewrites.push_back({location, nodes[dependency].sonamePatch.data()});
+
+            create_unique_target(node.path.data(), node.fd, node.location, node.sonamePatch.data(), rewrites, rewrites.empty() ? info : &rewriteInfo, node.target, node.stats);
+        });
+    }
+
+    for (auto &node : nodes)
+        close(node.fd);
+
+    // Dependencies are loaded first so the rewritten DT_NEEDED entries of the libraries that need them resolve to their batch instances
+    bool loadedAll{prepared};
+    for (auto i : order) {
+        auto &node{nodes[i]};
+        if (node.target.fd == -1) {
+            release_unique_target(node.target);
+            loadedAll = false;
+            continue;
+        }
+
+        handles[i] = load_unique_target(node.path.data(), node.target, requests[i].flags, ns, info, node.stats);
+        loadedAll &= handles[i] != nullptr;
+    }
+
+    // Anything that wasn't loaded still needs its ID returned
+    for (auto &node : nodes) {
+        if (!prepared)
+            release_unique_target(node.target);
+
+        record_unique_stats(node.stats, info);
+    }
+
+    return loadedAll;
+}
+
+namespace {
+    /**
+     * @brief A small pool of background threads owned by the library that asynchronous loads run on
+     * @note Threads are only started once there is work for them, so processes that never load asynchronously don't pay for them
+     */
+    class Executor {
+      private:
+        static constexpr size_t MaxThreads{2}; //!< Loads are mostly I/O bound and patch in parallel internally, so more threads would mostly contend
+
+        std::mutex mutex;
+        std::condition_variable condition;
+        std::deque<std::function<void()>> jobs;
+        size_t threadCount{};
+        size_t idleCount{};
+
+        void Run() {
+            while (true) {
+                std::function<void()> job;
+                {
+                    std::unique_lock lock{mutex};
+                    idleCount++;
+                    condition.wait(lock, [this]() { return !jobs.empty(); });
+                    idleCount--;
+
+                    job = std::move(jobs.front());
+                    jobs.pop_front();
+                }
+
+                job();
+            }
+        }
+
+      public:
+        void Submit(std::function<void()> job) {
+            std::scoped_lock lock{mutex};
+            jobs.push_back(std::move(job));
+
+            if (idleCount < jobs.size() && threadCount < MaxThreads) {
+                threadCount++;
+                std::thread{&Executor::Run, this}.detach();
+            }
+
+            condition.notify_one();
+        }
+    };
+}
+
+/**
+ * @note The executor is intentionally leaked so its threads never outlive it during process exit
+ */
+static Executor &get_executor() {
+    static auto executor{new Executor{}};
+    return *executor;
+}
+
+struct linkernsbypass_async_t {
+    std::atomic<uint32_t> refCount{2}; //!< One reference is held by the caller and the other by the job
+    std::mutex mutex;
+    std::condition_variable condition;
+    bool ready{};
+    void *handle{};
+
+    // Copies of the request, the caller's copies may be gone by the time the job runs
+    std::array<char, PATH_MAX> libPath{};
+    std::array<char, PATH_MAX> targetDir{};
+    linkernsbypass_unique_info info{};
+    android_dlextinfo extInfo{};
+};
+
+static void release_async(linkernsbypass_async_t *async) {
+    if (async->refCount.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        delete async;
+}
+
+linkernsbypass_async_t *linkernsbypass_namespace_dlopen_unique_async(const char *libPath, int flags, android_namespace_t *ns, const linkernsbypass_unique_info *info,
+                                                                   linkernsbypass_async_callback_t callback, void *userData) {
+    auto async{new linkernsbypass_async_t{}};
+    snprintf(async->libPath.data(), async->libPath.size(), "%s", libPath);
+
+    async->info = *info;
+    if (info->target_dir) {
+        snprintf(async->targetDir.data(), async->targetDir.size(), "%s", info->target_dir);
+        async->info.target_dir = async->targetDir.data();
+    }
+
+    if (info->extinfo) {
+        async->extInfo = *info->extinfo;
+        async->info.extinfo = &async->extInfo;
+    }
+
+    get_executor().Submit([async, flags, ns, callback, userData]() {
+        TraceSection trace{"linkernsbypass_namespace_dlopen_unique_async"};
+        auto handle{linkernsbypass_namespace_dlopen_unique_ext(async->libPath.data(), flags, ns, &async->info)};
+
+        {
+            std::scoped_lock lock{async->mutex};
+            async->handle = handle;
+            async->ready = true;
+        }
+        async->condition.notify_all();
+
+        if (callback)
+            callback(handle, userData);
+
+        release_async(async);
+    });
+
+    return async;
+}
+
+bool linkernsbypass_async_poll(linkernsbypass_async_t *async, void **handle) {
+    std::scoped_lock lock{async->mutex};
+    if (async->ready && handle)
+        *handle = async->handle;
+
+    return async->ready;
+}
+
+void *linkernsbypass_async_wait(linkernsbypass_async_t *async) {
+    std::unique_lock lock{async->mutex};
+    async->condition.wait(lock, [async]() { return async->ready; });
+    return async->handle;
+}
+
+void linkernsbypass_async_release(linkernsbypass_async_t *async) {
+    if (async)
+        release_async(async);
+}
+
+bool linkernsbypass_prewarm(const char *libPath, size_t count) {
+    int libFd{open(libPath, O_RDONLY | O_CLOEXEC)};
+    if (libFd == -1)
+        return false;
+
+    // Start reading the library into the page cache straight away, this doesn't block and means the copies never wait on storage
+    posix_fadvise(libFd, 0, 0, POSIX_FADV_WILLNEED);
+    close(libFd);
+
+    std::string path{libPath};
+    for (size_t i{}; i < count; i++) {
+        get_executor().Submit([path]() {
+            TraceSection trace{"linkernsbypass_prewarm"};
+
+            linkernsbypass_unique_info info{};
+            linkernsbypass_unique_stats stats{};
+            auto target{prepare_new_unique_target(path.c_str(), &info, stats)};
+
+            // The load is counted once the copy is actually used
+            stats.loads = 0;
+            stats.memfd_targets = 0;
+            record_unique_stats(stats, nullptr);
+
+            if (target.fd == -1)
+                return;
+
+            std::scoped_lock lock{prewarmedTargetsMutex};
+            prewarmedTargets.push_back({path, target});
+        });
+    }
+
+    return true;
+}
+
+void linkernsbypass_prewarm_release(const char *libPath) {
+    std::scoped_lock lock{prewarmedTargetsMutex};
+    auto unused{std::remove_if(prewarmedTargets.begin(), prewarmedTargets.end(), [libPath](PrewarmedTarget &prewarmed) {
+        if (libPath && prewarmed.libPath != libPath)
+            return false;
+
+        release_unique_target(prewarmed.target);
+        return true;
+    })};
+    prewarmedTargets.erase(unused, prewarmedTargets.end());
+}
+
+struct linkernsbypass_template_t {
+    int fd; //!< A sealed memfd holding an unmodified copy of the library
+    elf_soname_location sonameLocation; //!< The location of the soname in the library, cached so instances don't need to parse it again
+    std::array<char, PATH_MAX> name; //!< The path of the source library, used to name instance memfds
+};
+
+linkernsbypass_template_t *linkernsbypass_template_create(const char *libPath) {
+    int libFd{open(libPath, O_RDONLY | O_CLOEXEC)};
+    if (libFd == -1)
+        return nullptr;
+
+    int templateFd{create_memfd(libPath, MFD_CLOEXEC | MFD_ALLOW_SEALING)};
+
+    elf_soname_location location{};
+    bool created{templateFd != -1 && elf_soname_locate(libFd, &location) && elf_copy_file(libFd, templateFd, location.size)};
+    close(libFd);
+
+    // Seal the template so it's guaranteed to stay pristine for every instance created from it
+    if (!created || fcntl(templateFd, F_ADD_SEALS, F_SEAL_WRITE | F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) == -1) {
+        if (templateFd != -1)
+            close(templateFd);
+        return nullptr;
+    }
+
+    auto libTemplate{new linkernsbypass_template_t{}};
+    libTemplate->fd = templateFd;
+    libTemplate->sonameLocation = location;
+    snprintf(libTemplate->name.data(), libTemplate->name.size(), "%s", libPath);
+
+    return libTemplate;
+}
+
+/**
+ * @brief Copies the library held by `libTemplate` into `targetFd` and patches its soname, this is the template equivalent of patch_unique_target
+ */
+static bool patch_from_template(const linkernsbypass_template_t *libTemplate, int targetFd, const char *sonamePatch, linkernsbypass_unique_stats &stats) {
+    TraceSection trace{"elf_soname_patch"};
+
+    // The template is already in memory, so this is just a memory copy followed by a 3 byte write
+    auto copyStart{get_time_ns()};
+    if (!elf_copy_file(libTemplate->fd, targetFd, libTemplate->sonameLocation.size))
+        return false;
+
+    auto patchStart{get_time_ns()};
+    stats.copy_ns += patchStart - copyStart;
+    stats.bytes_copied += libTemplate->sonameLocation.size;
+
+    bool written{elf_soname_write(targetFd, &libTemplate->sonameLocation, sonamePatch)};
+    stats.patch_ns += get_time_ns() - patchStart;
+    return written;
+}
+
+void *linkernsbypass_namespace_dlopen_template(linkernsbypass_template_t *libTemplate, int flags, android_namespace_t *ns) {
+    linkernsbypass_unique_stats stats{};
+    stats.loads = 1;
+    stats.memfd_targets = 1;
+    auto handle{[&]() -> void * {
+        FaultCounter faultCounter{stats};
+
+        SonamePatch sonamePatch{};
+        auto id{allocate_unique_id(libTemplate->sonameLocation, 0, sonamePatch)};
+        if (!id)
+            return nullptr;
+
+        UniqueTarget target{};
+        target.id = id;
+        target.sonameLocation = libTemplate->sonameLocation;
+        target.memfd = true;
+
+        auto createStart{get_time_ns()};
+        target.fd = create_memfd(libTemplate->name.data(), 0);
+        stats.target_create_ns += get_time_ns() - createStart;
+
+        if (target.fd != -1 && !patch_from_template(libTemplate, target.fd, sonamePatch.data(), stats)) {
+            close(target.fd);
+            target.fd = -1;
+        }
+
+        if (target.fd == -1) {
+            release_unique_target(target);
+            return nullptr;
+        }
+
+        return load_unique_target(libTemplate->name.data(), target, flags, ns, nullptr, stats);
+    }()};
+
+    record_unique_stats(stats, nullptr);
+    return handle;
+}
+
+void linkernsbypass_template_destroy(linkernsbypass_template_t *libTemplate) {
+    if (!libTemplate)
+        return;
+
+    close(libTemplate->fd);
+    delete libTemplate;
+}
+
+static void *align_ptr(void *ptr) {
+    return reinterpret_cast<void *>(reinterpret_cast<uintptr_t>(ptr) & ~(getpagesize() - 1));
+}
+
+#ifndef PROT_BTI
+    #define PROT_BTI 0x10
+#endif
+
+/**
+ * @brief Reads the protection of the mapping containing `address` from /proc/self/smaps, this includes PROT_BTI which isn't visible in /proc/self/maps
+ * @return The protection flags of the mapping, or -1 if it couldn't be found
+ */
+static int get_mapping_protection(uintptr_t address) {
+    FILE *smaps{fopen("/proc/self/smaps", "re")};
+    if (!smaps)
+        return -1;
+
+    int prot{-1};
+    bool inMapping{};
+    std::array<char, 512> line{};
+    while (fgets(line.data(), line.size(), smaps)) {
+        uintptr_t start{}, end{};
+        std::array<char, 5> perms{};
+        if (sscanf(line.data(), "%" SCNxPTR "-%" SCNxPTR " %4s", &start, &end, perms.data()) == 3) {
+            // Reaching the next mapping means the kernel doesn't report VmFlags, so we have all there is
+            if (inMapping)
+                break;
+
+            inMapping = address >= start && address < end;
+            if (inMapping)
+                prot = (perms[0] == 'r' ? PROT_READ : 0) | (perms[1] == 'w' ? PROT_WRITE : 0) | (perms[2] == 'x' ? PROT_EXEC : 0);
+        } else if (inMapping && !strncmp(line.data(), "VmFlags:", 8)) {
+            if (strstr(line.data(), " bt"))
+                prot |= PROT_BTI;
+            break;
+        }
+    }
+
+    fclose(smaps);
+    return prot;
+}
+
+/**
+ * @brief Reads the instructions of the function at `address` (of `size` bytes) from the on-disk copy of the object containing it
+ * @note This avoids touching the in-memory text which may be mapped execute-only
+ */
+static bool read_function_from_file(uintptr_t address, size_t size, std::vector<uint32_t> &instructions) {
+    struct ObjectInfo {
+        uintptr_t address;
+        const char *name;
+        uint64_t fileOffset; //!< The file offset of `address`
+    } object{};
+    object.address = address;
+
+    bool found{dl_iterate_phdr([](dl_phdr_info *info, size_t, void *data) {
+        auto &object{*reinterpret_cast<ObjectInfo *>(data)};
+        for (ElfW(Half) i{}; i < info->dlpi_phnum; i++) {
+            auto &pHdr{info->dlpi_phdr[i]};
+            uintptr_t start{info->dlpi_addr + pHdr.p_vaddr};
+            if (pHdr.p_type == PT_LOAD && object.address >= start && object.address - start < pHdr.p_filesz) {
+                object.name = info->dlpi_name;
+                object.fileOffset = pHdr.p_offset + (object.address - start);
+                return 1;
+            }
+        }
+        return 0;
+    }, &object) != 0};
+    if (!found || !object.name)
+        return false;
+
+    int fd{open(object.name, O_RDONLY | O_CLOEXEC)};
+    if (fd == -1)
+        return false;
+
+    instructions.resize(size / sizeof(uint32_t));
+    auto readSize{static_cast<ssize_t>(instructions.size() * sizeof(uint32_t))};
+    bool read{pread(fd, instructions.data(), static_cast<size_t>(readSize), static_cast<off_t>(object.fileOffset)) == readSize};
+    close(fd);
+
+    return read;
+}
+
+/**
+ * @brief Looks up the size of the exported function at `address` from the .dynsym of the object containing it
+ * @return The size of the function in bytes, or 0 if it couldn't be found
+ */
+static size_t get_function_size(uintptr_t address) {
+    struct SymbolInfo {
+        uintptr_t address;
+        size_t size;
+    } symbol{};
+    symbol.address = address;
+
+    dl_iterate_phdr([](dl_phdr_info *info, size_t, void *data) {
+        auto &symbol{*reinterpret_cast<SymbolInfo *>(data)};
+        const ElfW(Dyn) *dynamic{};
+        bool contains{};
+        for (ElfW(Half) i{}; i < info->dlpi_phnum; i++) {
+            auto &pHdr{info->dlpi_phdr[i]};
+            uintptr_t start{info->dlpi_addr + pHdr.p_vaddr};
+            if (pHdr.p_type == PT_DYNAMIC)
+                dynamic = reinterpret_cast<const ElfW(Dyn) *>(start);
+            else if (pHdr.p_type == PT_LOAD && symbol.address >= start && symbol.address - start < pHdr.p_memsz)
+                contains = true;
+        }
+        if (!contains || !dynamic)
+            return 0;
+
+        // .dynamic lives in a readable segment unlike the text, bionic leaves its pointers unrelocated while glibc relocates them
+        auto relocate{[info](ElfW(Addr) ptr) {
+            return ptr < info->dlpi_addr ? info->dlpi_addr + ptr : ptr;
+        }};
+
+        const ElfW(Sym) *symTab{};
+        const uint32_t *hashTab{}, *gnuHashTab{};
+        for (auto entry{dynamic}; entry->d_tag != DT_NULL; entry++) {
+            if (entry->d_tag == DT_SYMTAB)
+                symTab = reinterpret_cast<const ElfW(Sym) *>(relocate(entry->d_un.d_ptr));
+            else if (entry->d_tag == DT_HASH)
+                hashTab = reinterpret_cast<const uint32_t *>(relocate(entry->d_un.d_ptr));
+            else if (entry->d_tag == DT_GNU_HASH)
+                gnuHashTab = reinterpret_cast<const uint32_t *>(relocate(entry->d_un.d_ptr));
+        }
+
+        // The symbol count isn't stored directly, DT_HASH has it as nchain but with DT_GNU_HASH it needs to be found from the end of the last chain
+        uint32_t symCount{};
+        if (hashTab) {
+            symCount = hashTab[1];
+        } else if (gnuHashTab && gnuHashTab[0]) {
+            auto bucketCount{gnuHashTab[0]}, symOffset{gnuHashTab[1]}, bloomSize{gnuHashTab[2]};
+            auto buckets{reinterpret_cast<const uint32_t *>(reinterpret_cast<const ElfW(Addr) *>(&gnuHashTab[4]) + bloomSize)};
+            auto chains{buckets + bucketCount};
+
+            uint32_t lastSym{*std::max_element(buckets, buckets + bucketCount)};
+            if (lastSym >= symOffset)
+                while (!(chains[lastSym - symOffset] & 1))
+                    lastSym++;
+            symCount = lastSym + 1;
+        }
+
+        if (!symTab)
+            return 1;
+
+        for (uint32_t i{}; i < symCount; i++) {
+            auto &sym{symTab[i]};
+            if (ELF64_ST_TYPE(sym.st_info) == STT_FUNC && sym.st_shndx != SHN_UNDEF && info->dlpi_addr + sym.st_value == symbol.address) {
+                symbol.size = sym.st_size;
+                break;
+            }
+        }
+
+        return 1;
+    }, &symbol);
+
+    return symbol.size;
+}
+
+/**
+ * @brief Locates the internal handler that dlopen forwards to without making any of libdl's text writable
+ */
+static void *find_loader_dlopen() {
+    union BranchLinked {
+        uint32_t raw;
+
+        struct {
+            int32_t offset : 26; //!< 26-bit branch offset
+            uint8_t sig : 6;  //!< 6-bit signature
+        };
+
+        bool Verify() {
+            return sig == 0x25;
+        }
+    };
+    static_assert(sizeof(BranchLinked) == 4, "BranchLinked is wrong size");
+
+    // Used when the size of dlopen can't be determined, it's only a handful of instructions
+    constexpr size_t FallbackFunctionSize{64 * sizeof(uint32_t)};
+
+    auto dlopenAddress{reinterpret_cast<uintptr_t>(&dlopen)};
+    auto dlopenSize{get_function_size(dlopenAddress)};
+    if (!dlopenSize)
+        dlopenSize = FallbackFunctionSize;
+
+    // Some devices ship with --X mapping for executables so read the instructions from the file or through /proc/self/mem which ignores protections rather than from memory
+    std::vector<uint32_t> instructions;
+    if (!read_function_from_file(dlopenAddress, dlopenSize, instructions)) {
+        int memFd{open("/proc/self/mem", O_RDONLY | O_CLOEXEC)};
+        if (memFd == -1)
+            return nullptr;
+
+        instructions.resize(dlopenSize / sizeof(uint32_t));
+        auto readSize{static_cast<ssize_t>(instructions.size() * sizeof(uint32_t))};
+        bool read{pread64(memFd, instructions.data(), static_cast<size_t>(readSize), static_cast<off64_t>(dlopenAddress)) == readSize};
+        close(memFd);
+        if (!read)
+            return nullptr;
+    }
+
+    // dlopen is just a wrapper for __loader_dlopen that passes the return address as the third arg hence we can just walk it to find __loader_dlopen
+    for (size_t i{}; i < instructions.size(); i++) {
+        BranchLinked blInstr{.raw = instructions[i]};
+        if (blInstr.Verify())
+            return reinterpret_cast<uint32_t *>(dlopenAddress) + i + blInstr.offset;
+    }
+
+    return nullptr;
+}
+
+/* Private */
+static void resolve_linker_symbols() {
+    using loader_dlopen_t = void *(*)(const char *, int, const void *);
+
+    TraceSection trace{"resolve_linker_symbols"};
+
+    if (android_get_device_api_level() < 28)
+        return;
+
+    // If the order of these changes then CacheVersion in linker_symbol_cache.cpp must be bumped
+    auto cachedSymbols{std::array<void **, 4>{
+        reinterpret_cast<void **>(&android_link_namespaces_all_libs),
+        reinterpret_cast<void **>(&android_link_namespaces),
+        reinterpret_cast<void **>(&loader_android_create_namespace),
+        reinterpret_cast<void **>(&android_get_exported_namespace),
+    }};
+    std::array<void *, cachedSymbols.size()> symbols{};
+
+    // A valid cache lets us skip everything below, including the loader_dlopen walk
+    if (symbolCacheDir[0] && linker_symbol_cache_load(symbolCacheDir.data(), symbols.data(), symbols.size())) {
+        for (size_t i{}; i < symbols.size(); i++)
+            *cachedSymbols[i] = symbols[i];
+
+        lib_loaded = true;
+        return;
+    }
+
+    auto loader_dlopen{reinterpret_cast<loader_dlopen_t>(find_loader_dlopen())};
+    if (!loader_dlopen)
+        return;
+
+    // The target isn't intended to be jumped to indirectly so it may lack a BTI landing pad, strip BTI from its page only for as long as we need to call it
+    auto loaderDlopenPage{align_ptr(reinterpret_cast<void *>(loader_dlopen))};
+    auto loaderDlopenProt{get_mapping_protection(reinterpret_cast<uintptr_t>(loaderDlopenPage))};
+    bool stripBti{loaderDlopenProt > 0 && (loaderDlopenProt & PROT_BTI)};
+    if (stripBti)
+        mprotect(loaderDlopenPage, getpagesize(), loaderDlopenProt & ~PROT_BTI);
+
+    // Passing dlopen as a caller address tricks the linker into using the internal unrestricted namespace letting us access libraries that are normally forbidden in the classloader namespace imposed on apps
+    auto ldHandle{loader_dlopen("ld-android.so", RTLD_LAZY, reinterpret_cast<void *>(&dlopen))};
+    auto libdlAndroidHandle{loader_dlopen("libdl_android.so", RTLD_LAZY, reinterpret_cast<void *>(&dlopen))};
+    if (stripBti)
+        mprotect(loaderDlopenPage, getpagesize(), loaderDlopenProt);
+
+    if (!ldHandle)
+        return;
+
+    android_link_namespaces_all_libs = reinterpret_cast<android_link_namespaces_all_libs_t>(dlsym(ldHandle, "__loader_android_link_namespaces_all_libs"));
+    if (!android_link_namespaces_all_libs)
+        return;
+
+    android_link_namespaces = reinterpret_cast<android_link_namespaces_t>(dlsym(ldHandle, "__loader_android_link_namespaces"));
+    if (!android_link_namespaces)
+        return;
+
+    if (!libdlAndroidHandle)
+        return;
+
+    loader_android_create_namespace = reinterpret_cast<loader_android_create_namespace_t>(dlsym(libdlAndroidHandle, "__loader_android_create_namespace"));
+    if (!loader_android_create_namespace)
+        return;
+
+    android_get_exported_namespace = reinterpret_cast<android_get_exported_namespace_t>(dlsym(libdlAndroidHandle, "__loader_android_get_exported_namespace"));
+    if (!android_get_exported_namespace)
+        return;
+
+    if (symbolCacheDir[0]) {
+        for (size_t i{}; i < symbols.size(); i++)
+            symbols[i] = *cachedSymbols[i];
+
+        linker_symbol_cache_store(symbolCacheDir.data(), symbols.data(), symbols.size());
+    }
 
     // Lib is now safe to use
     lib_loaded = true;
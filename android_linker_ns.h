@@ -7,7 +7,9 @@
 extern "C" {
 #endif
 
+#include <stddef.h>
 #include <stdint.h>
+#include <android/dlext.h>
 
 // https://cs.android.com/android/platform/superproject/+/0a492a4685377d41fef2b12e9af4ebfa6feef9c2:art/libnativeloader/include/nativeloader/dlext_namespaces.h;l=25;bpv=1;bpt=1
 enum {
@@ -21,11 +23,24 @@ enum {
 
 /**
  * @brief Checks if linkernsbypass loaded successfully and is safe to use
- * @note IMPORTANT: This should be called before any calls to the rest of the library are made
+ * @note IMPORTANT: This should be called before any calls to the rest of the library are made, the linker symbols are resolved on the first call to this rather than at load time
  * @return true if loading succeeded
  */
 bool linkernsbypass_load_status();
 
+/**
+ * @brief Enables or disables emitting ATrace sections around namespace creation, linking, patching and loading
+ * @note This is disabled by default and costs nothing beyond a single flag check while disabled, sections are only emitted while a trace is being captured
+ */
+void linkernsbypass_set_tracing(bool enabled);
+
+/**
+ * @brief Enables caching of the resolved linker entry points in `cacheDir` so later launches can skip resolving them
+ * @note IMPORTANT: This must be called before linkernsbypass_load_status to have any effect, the cache is keyed by the GNU build-id of the objects containing the entry points
+ * @param cacheDir A directory private to the app that persists across launches, or nullptr to disable caching
+ */
+void linkernsbypass_set_symbol_cache_dir(const char *cacheDir);
+
 // https://cs.android.com/android/platform/superproject/+/0a492a4685377d41fef2b12e9af4ebfa6feef9c2:art/libnativeloader/include/nativeloader/dlext_namespaces.h;l=86;bpv=1;bpt=1
 struct android_namespace_t *android_create_namespace(const char *name,
                                                      const char *ld_library_path,
@@ -53,11 +68,71 @@ extern android_link_namespaces_all_libs_t android_link_namespaces_all_libs;
 typedef bool (*android_link_namespaces_t)(struct android_namespace_t *, struct android_namespace_t *, const char *);
 extern android_link_namespaces_t android_link_namespaces;
 
+/**
+ * @brief Like android_create_namespace but returns the namespace created by an earlier call with an identical configuration rather than creating a duplicate
+ * @note Namespaces are matched on their name, paths, type and parent, as well as the namespace of the calling library since that's what the linker uses in place of a null parent
+ */
+struct android_namespace_t *linkernsbypass_get_or_create_namespace(const char *name,
+                                                                   const char *ld_library_path,
+                                                                   const char *default_library_path,
+                                                                   uint64_t type,
+                                                                   const char *permitted_when_isolated_path,
+                                                                   struct android_namespace_t *parent_namespace);
+
+/**
+ * @brief Like android_create_namespace_escape but returns the namespace created by an earlier call with an identical configuration rather than creating a duplicate
+ */
+struct android_namespace_t *linkernsbypass_get_or_create_namespace_escape(const char *name,
+                                                                          const char *ld_library_path,
+                                                                          const char *default_library_path,
+                                                                          uint64_t type,
+                                                                          const char *permitted_when_isolated_path,
+                                                                          struct android_namespace_t *parent_namespace);
+
+/**
+ * @brief Returns a shared copy of the default namespace that can be used as a link target, this is created on the first call and reused by every later one
+ * @note There is no way to get a direct handle to the default namespace as it isn't exported, a shared namespace with the default parent has the same libraries and is what the linking helpers use
+ */
+struct android_namespace_t *linkernsbypass_get_default_namespace();
+
 /**
  * @brief Like android_link_namespaces_all_libs but links from the default namespace
  */
 bool linkernsbypass_link_namespace_to_default_all_libs(struct android_namespace_t *to);
 
+/**
+ * @brief Like android_link_namespaces but links from the default namespace
+ * @param sharedLibsSonames A colon separated list of the sonames of the libraries to share from the default namespace
+ */
+bool linkernsbypass_link_namespace_to_default(struct android_namespace_t *to, const char *sharedLibsSonames);
+
+typedef struct {
+  const char *name; //!< The name of the namespace
+  const char *ld_library_path; //!< The library search path of the namespace, may be nullptr
+  const char *default_library_path; //!< The default library search path of the namespace, may be nullptr
+  uint64_t type; //!< A bitmask of ANDROID_NAMESPACE_TYPE_* flags
+  const char *permitted_when_isolated_path; //!< The paths libraries can be loaded from if the namespace is isolated, may be nullptr
+  int parent; //!< The index of the parent namespace in the graph, this must be lower than the index of this namespace, or -1 for the namespace of the caller
+} linkernsbypass_namespace_node;
+
+typedef struct {
+  int from; //!< The index of the namespace in the graph that gains access to the libraries
+  int to; //!< The index of the namespace in the graph that the libraries are shared from, or -1 for the default namespace
+  const char *shared_libs_sonames; //!< A colon separated list of the sonames of the libraries to share, this must name at least one library, or nullptr to share all of them
+} linkernsbypass_namespace_edge;
+
+/**
+ * @brief Creates (or reuses, see linkernsbypass_get_or_create_namespace) every namespace in a graph and links them together in a single call
+ * @note Edges between the same pair of namespaces are merged into a single link with the union of their soname lists, an edge that shares all libraries makes the merged link share all of them
+ * @note Prefer narrow soname lists over sharing all libraries where possible, they keep the lookup chains the linker walks for every symbol shorter
+ * @note If an edge is out of range, links a namespace to itself or has an empty soname list, this fails with errno set to EINVAL before creating anything
+ * @param nodes An array of `nodeCount` namespaces to create
+ * @param edges An array of `edgeCount` links to create between the namespaces
+ * @param namespaces An array of `nodeCount` entries that is filled with the namespace for each entry in `nodes`, or nullptr if it couldn't be created
+ * @return true if every namespace was created and every link succeeded, namespaces that were created are kept even if this fails
+ */
+bool linkernsbypass_create_namespace_graph(const linkernsbypass_namespace_node *nodes, size_t nodeCount, const linkernsbypass_namespace_edge *edges, size_t edgeCount, struct android_namespace_t **namespaces);
+
 /**
  * @brief Loads a library into a namespace
  * @note IMPORTANT: If `filename` is compiled with the '-z global' linker flag and RTLD_GLOBAL is supplied in `flags` the library will be added to the namespace's LD_PRELOAD list
@@ -67,8 +142,28 @@ bool linkernsbypass_link_namespace_to_default_all_libs(struct android_namespace_
  */
 void *linkernsbypass_namespace_dlopen(const char *filename, int flags, struct android_namespace_t *ns);
 
+/**
+ * @brief Like linkernsbypass_namespace_dlopen but with additional android_dlextinfo options, such as ANDROID_DLEXT_WRITE_RELRO/ANDROID_DLEXT_USE_RELRO for RELRO sharing
+ * @param filename The name of the library to load
+ * @param flags The rtld flags for `filename`
+ * @param ns The namespace to dlopen into
+ * @param extInfo Extra options for the load, ANDROID_DLEXT_USE_NAMESPACE and `library_namespace` are always overridden, may be nullptr
+ */
+void *linkernsbypass_namespace_dlopen_ext(const char *filename, int flags, struct android_namespace_t *ns, const android_dlextinfo *extInfo);
+
+/**
+ * @brief Resolves many symbols from a handle in one call, looking them up in the hash table of the library directly rather than taking the linker lock and walking the lookup scope for each one
+ * @note The library is identified through the first symbol in `names` that dlsym can resolve, if that symbol is defined by an object that any other loaded object depends on (so it may be a dependency of the library rather than the library itself) every symbol is resolved with dlsym instead to keep its precedence
+ * @note Symbols the library doesn't define itself, as well as TLS and IFUNC symbols, are resolved with dlsym
+ * @param names An array of `count` symbol names
+ * @param addresses An array of `count` entries that is filled with the address of each symbol in `names`, or nullptr if it couldn't be resolved
+ * @return The number of symbols that were resolved
+ */
+size_t linkernsbypass_dlsym_bulk(void *handle, const char *const *names, size_t count, void **addresses);
+
 /**
  * @brief Force loads a unique instance of a library into a namespace
+ * @note This is safe to call concurrently from multiple threads, the copying and patching of each library happens in parallel
  * @param libPath The path to the library to load with hooks applied
  * @param libTargetDir A temporary directory to hold the soname patched library at `libPath`, will attempt to use memfd if nullptr
  * @param flags The rtld flags for `libName`
@@ -76,6 +171,400 @@ void *linkernsbypass_namespace_dlopen(const char *filename, int flags, struct an
  */
 void *linkernsbypass_namespace_dlopen_unique(const char *libPath, const char *libTargetDir, int flags, struct android_namespace_t *ns);
 
+enum {
+  /**
+   * Keep soname patched libraries in `target_dir` across process launches and reuse them for as long as the source library is unchanged
+   * @note Cached copies are keyed by the source path, size, mtime and unique ID; `target_dir` must be set to use this
+   */
+  LINKERNSBYPASS_UNIQUE_PERSISTENT_CACHE = 0x1,
+
+  /**
+   * Store the soname patched library in an anonymous file in `target_dir` (with O_TMPFILE, or by unlinking it straight after creation) so it never has a directory entry and is never committed to storage
+   * @note This is ignored if LINKERNSBYPASS_UNIQUE_PERSISTENT_CACHE is set, as cached copies need to be named
+   */
+  LINKERNSBYPASS_UNIQUE_ANONYMOUS_FILE = 0x2,
+
+  /**
+   * Seal the memfd holding the soname patched library against writes and resizing once it has been patched
+   * @note This only applies when `target_dir` is nullptr
+   */
+  LINKERNSBYPASS_UNIQUE_SEALED = 0x4,
+
+  /**
+   * Load instances into their arena slot with ANDROID_DLEXT_RESERVED_ADDRESS_HINT rather than ANDROID_DLEXT_RESERVED_ADDRESS, so libraries too large for a slot are loaded elsewhere instead of failing
+   * @note This only applies when `arena` is set
+   */
+  LINKERNSBYPASS_UNIQUE_ARENA_HINT = 0x8,
+
+  /**
+   * Back the memfd holding the soname patched library with transparent huge pages and load it at an address where its executable segment can be mapped with 2MB pages, cutting iTLB misses in large libraries
+   * @note This needs shmem THP to be enabled (/sys/kernel/mm/transparent_hugepage/shmem_enabled set to advise, within_size or always) and regular pages are silently used otherwise, it only applies when `target_dir` is nullptr
+   * @note The load address is only chosen by the library when neither `arena` nor a reserved address in `extinfo` is set, otherwise the caller is responsible for picking a suitably aligned one
+   */
+  LINKERNSBYPASS_UNIQUE_HUGE_PAGES = 0x10,
+
+  /**
+   * Also load unique instances of every library in the DT_NEEDED closure of `libPath` that lives in the same directory as it, with the DT_NEEDED strings of each copy rewritten to the patched sonames of its dependencies
+   * @note Dependencies are found by soname and anything not in the directory is shared as usual, the whole closure is patched in parallel and then loaded with dependencies first
+   * @note This is only supported by linkernsbypass_namespace_dlopen_unique_ext and linkernsbypass_namespace_dlopen_unique_handle, LINKERNSBYPASS_UNIQUE_PERSISTENT_CACHE is ignored as each copy depends on the IDs of its dependencies
+   */
+  LINKERNSBYPASS_UNIQUE_RECURSIVE = 0x20,
+
+  /**
+   * Skip the copy and load the library directly with linkernsbypass_namespace_dlopen_ext if no library with the same soname is loaded yet, as the load is then guaranteed to create a new instance anyway
+   * @note The linker doesn't expose which namespace a library belongs to and namespaces can be linked to each other, so a library with the same soname loaded anywhere in the process always results in a copy
+   */
+  LINKERNSBYPASS_UNIQUE_IF_NEEDED = 0x40,
+
+  /**
+   * Map the read-only segments of a memfd copy that the soname patch doesn't touch from the source library instead after loading, so their pages are shared with every other instance and the source itself
+   * @note The source library is kept open until the instance is loaded, this has no effect with LINKERNSBYPASS_UNIQUE_HUGE_PAGES as the text would no longer be backed by huge pages
+   */
+  LINKERNSBYPASS_UNIQUE_SHARE_UNMODIFIED = 0x80,
+};
+
+/**
+ * @brief A single reserved region of address space split into fixed size slots that unique instances are packed into
+ */
+struct linkernsbypass_arena_t;
+
+/**
+ * @brief Reserves an arena of `slotCount` slots, each large enough to hold one instance of a library
+ * @note The whole arena is reserved up front as a single PROT_NONE mapping, so instances loaded into it sit next to each other rather than wherever the linker picks
+ * @param slotSize The size of each slot in bytes, this is rounded up to the page size and must be at least the size of the largest library loaded into the arena
+ * @param slotCount The number of slots in the arena
+ * @return The arena, or nullptr on failure
+ */
+struct linkernsbypass_arena_t *linkernsbypass_arena_create(size_t slotSize, size_t slotCount);
+
+/**
+ * @brief Releases the address space reserved by an arena
+ * @return false if any instance is still loaded into the arena, in which case it is left untouched
+ */
+bool linkernsbypass_arena_destroy(struct linkernsbypass_arena_t *arena);
+
+/**
+ * @brief Timings and counters for unique loads, these are accumulated across every load they cover
+ */
+typedef struct {
+  uint64_t loads; //!< The number of unique loads covered
+  uint64_t memfd_targets; //!< The number of loads that stored the patched library in a memfd
+  uint64_t file_targets; //!< The number of loads that stored the patched library in a file in `target_dir`
+  uint64_t cache_hits; //!< The number of loads that reused a patched library from the persistent cache
+  uint64_t target_create_ns; //!< Time spent creating the memfd or opening the file to hold the patched library
+  uint64_t parse_ns; //!< Time spent locating the soname in the source library
+  uint64_t copy_ns; //!< Time spent copying the source library
+  uint64_t patch_ns; //!< Time spent writing the soname patch
+  uint64_t dlopen_ns; //!< Time spent in android_dlopen_ext
+  uint64_t bytes_copied; //!< The number of bytes copied from source libraries
+  uint64_t minor_faults; //!< Minor page faults incurred by the loading threads
+  uint64_t major_faults; //!< Major page faults incurred by the loading threads
+  uint64_t direct_loads; //!< The number of loads that skipped copying the library with LINKERNSBYPASS_UNIQUE_IF_NEEDED, these are also counted in `loads`
+  uint64_t prewarm_hits; //!< The number of loads that used a copy created ahead of time by linkernsbypass_prewarm, these are also counted in `loads` and `memfd_targets`
+  uint64_t bytes_reclaimed; //!< The number of bytes of memfd copies that were freed after loading as the linker doesn't map them
+  uint64_t prepatched_loads; //!< The number of loads of variants pre-patched by elf_soname_prepatch, these are also counted in `loads`
+} linkernsbypass_unique_stats;
+
+typedef struct {
+  uint64_t flags; //!< A bitmask of LINKERNSBYPASS_UNIQUE_* flags
+  const char *target_dir; //!< A directory to hold the soname patched library, will attempt to use memfd if nullptr
+  linkernsbypass_unique_stats *stats; //!< If non-null the stats of the load are added to this, it is not zeroed beforehand
+  const android_dlextinfo *extinfo; //!< Extra options for android_dlopen_ext such as RELRO sharing (which also needs the instance to be loaded at a fixed address with ANDROID_DLEXT_RESERVED_ADDRESS to be useful), the namespace and library FD are always overridden, may be nullptr
+  uint32_t id_width; //!< The number of leading soname characters to overwrite with the decimal unique ID, this defaults to 3 (1000 concurrent instances) if 0 and is limited to the soname length or 9, whichever is lower
+  struct linkernsbypass_arena_t *arena; //!< If non-null each instance is loaded into a free slot of this arena, which is returned to it once the instance is unloaded, this overrides any reserved address in `extinfo`
+} linkernsbypass_unique_info;
+
+/**
+ * @brief Like linkernsbypass_namespace_dlopen_unique but with extended options
+ * @param libPath The path to the library to load with hooks applied
+ * @param flags The rtld flags for `libPath`
+ * @param ns The namespace to dlopen into
+ * @param info Options controlling how the unique instance is created
+ */
+void *linkernsbypass_namespace_dlopen_unique_ext(const char *libPath, int flags, struct android_namespace_t *ns, const linkernsbypass_unique_info *info);
+
+/**
+ * @brief A reference counted unique instance of a library that can be unloaded again
+ */
+struct linkernsbypass_unique_t;
+
+/**
+ * @brief Like linkernsbypass_namespace_dlopen_unique_ext but returns an instance that can later be unloaded with linkernsbypass_unique_unload
+ * @param libPath The path to the library to load with hooks applied
+ * @param flags The rtld flags for `libPath`
+ * @param ns The namespace to dlopen into
+ * @param info Options controlling how the unique instance is created
+ * @return The instance with a single reference, or nullptr on failure
+ */
+struct linkernsbypass_unique_t *linkernsbypass_namespace_dlopen_unique_handle(const char *libPath, int flags, struct android_namespace_t *ns, const linkernsbypass_unique_info *info);
+
+/**
+ * @brief Loads a new instance of a library from a bundle of variants pre-patched offline by the elf_soname_prepatch tool, without copying or patching anything on device
+ * @note Variants are read from `<bundleDir>/<variant>/<libName>` and the first one whose soname isn't loaded yet is used, as the file is mapped directly its pages stay clean and are shared with every other process mapping it
+ * @param info Only `extinfo`, `arena` (along with LINKERNSBYPASS_UNIQUE_ARENA_HINT) and `stats` are used, may be nullptr
+ * @return A unique instance that can be unloaded with linkernsbypass_unique_unload, or nullptr if loading failed or every variant is already loaded
+ */
+struct linkernsbypass_unique_t *linkernsbypass_namespace_dlopen_prepatched(const char *bundleDir, const char *libName, int flags, struct android_namespace_t *ns, const linkernsbypass_unique_info *info);
+
+/**
+ * @return The dlopen handle of a unique instance, for use with dlsym
+ */
+void *linkernsbypass_unique_get_handle(struct linkernsbypass_unique_t *unique);
+
+/**
+ * @brief Adds a reference to a unique instance, each reference must be dropped with linkernsbypass_unique_unload
+ * @return `unique`
+ */
+struct linkernsbypass_unique_t *linkernsbypass_unique_retain(struct linkernsbypass_unique_t *unique);
+
+/**
+ * @brief Drops a reference to a unique instance, unloading it after the last one
+ * @note Unloading dlcloses the library and deletes its patched copy, once the library is really gone from the process its unique ID, arena slot and reserved address space are returned for reuse and instances of its dependencies loaded with LINKERNSBYPASS_UNIQUE_RECURSIVE are unloaded straight after it
+ * @return false if the last reference was dropped but dlclose failed or the linker kept the library loaded (e.g. DF_1_NODELETE), in which case the ID, slot and address space are never reused and the dependencies stay loaded
+ */
+bool linkernsbypass_unique_unload(struct linkernsbypass_unique_t *unique);
+
+typedef struct {
+  uint64_t shared_bytes; //!< Resident bytes of the instance backed by its copy or the source library, these are shared with anything else that maps the same pages
+  uint64_t private_bytes; //!< Resident bytes of the instance private to it, such as relocated data
+} linkernsbypass_unique_memory_usage;
+
+/**
+ * @brief Measures the resident memory of a unique instance from /proc/self/smaps, this is slow and intended for diagnostics
+ * @note Only mappings of the instance's copy are counted, segments remapped from the source library with LINKERNSBYPASS_UNIQUE_SHARE_UNMODIFIED aren't included
+ * @return If the usage could be read, this is always false for instances loaded directly with LINKERNSBYPASS_UNIQUE_IF_NEEDED as they have no copy
+ */
+bool linkernsbypass_unique_get_memory_usage(struct linkernsbypass_unique_t *unique, linkernsbypass_unique_memory_usage *usage);
+
+/**
+ * @brief Creates a sealed soname patched memfd copy of a library that can be shared with and loaded by other processes
+ * @note The unique ID used for the copy is never reused by this process, it is marked in the soname so it can't collide with the IDs of unique instances created by the processes that load the copy, however copies of the same library shared by different processes can still collide
+ * @note The marker takes up one character of `id_width`, so at least 2 are needed
+ * @param libPath The path to the library to create a copy of
+ * @param info Options controlling how the copy is created, `target_dir`, LINKERNSBYPASS_UNIQUE_PERSISTENT_CACHE and LINKERNSBYPASS_UNIQUE_SHARE_UNMODIFIED are ignored as the copy is always a memfd that isn't loaded by this process, may be nullptr
+ * @return A memfd sealed with F_SEAL_WRITE | F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL, or -1 on failure
+ */
+int linkernsbypass_create_shared_unique_fd(const char *libPath, const linkernsbypass_unique_info *info);
+
+/**
+ * @brief Sends an FD over a connected Unix domain socket using SCM_RIGHTS
+ * @return true on success
+ */
+bool linkernsbypass_send_fd(int socketFd, int fd);
+
+/**
+ * @brief Receives an FD sent with linkernsbypass_send_fd over a connected Unix domain socket
+ * @return The received FD (with O_CLOEXEC set), or -1 on failure
+ */
+int linkernsbypass_receive_fd(int socketFd);
+
+/**
+ * @brief Loads a library from an FD created by linkernsbypass_create_shared_unique_fd (in this or another process) into a namespace
+ * @note The FD must be sealed against writes and shrinking, so every process loading it shares the same pages
+ * @param fd The sealed memfd holding the library
+ * @param flags The rtld flags for the library
+ * @param ns The namespace to dlopen into
+ * @param extInfo Extra options for android_dlopen_ext, with ANDROID_DLEXT_USE_RELRO this can map a RELRO written by another process that loaded the same FD at the same address, may be nullptr
+ */
+void *linkernsbypass_namespace_dlopen_shared_fd(int fd, int flags, struct android_namespace_t *ns, const android_dlextinfo *extInfo);
+
+typedef struct {
+  const char *lib_path; //!< The path to the library to load with hooks applied
+  int flags; //!< The rtld flags for `lib_path`
+} linkernsbypass_unique_request;
+
+/**
+ * @brief Force loads unique instances of several libraries into a namespace, patching all of them in parallel
+ * @note DT_NEEDED entries that refer to another library in the batch (by soname) are rewritten to the patched soname of its instance, and dependencies are loaded before the libraries that need them regardless of the order they are supplied in
+ * @note LINKERNSBYPASS_UNIQUE_PERSISTENT_CACHE is ignored for libraries that depend on others in the batch, as their copies depend on the IDs of their dependencies
+ * @param requests An array of `count` libraries to load
+ * @param ns The namespace to dlopen into
+ * @param info Options controlling how the unique instances are created, these are shared by every library in the batch
+ * @param handles An array of `count` entries that is filled with the handle for each library in `requests`, or nullptr if that library failed to load
+ * @return true if every library was loaded successfully, nothing is loaded if the batch libraries depend on each other in a cycle or one of them couldn't be read
+ */
+bool linkernsbypass_namespace_dlopen_unique_batch(const linkernsbypass_unique_request *requests, size_t count, struct android_namespace_t *ns, const linkernsbypass_unique_info *info, void **handles);
+
+/**
+ * @brief A pending asynchronous unique load
+ */
+struct linkernsbypass_async_t;
+
+/**
+ * @brief Called on a background thread once an asynchronous unique load has finished
+ * @param handle The handle of the loaded library, or nullptr if loading failed
+ */
+typedef void (*linkernsbypass_async_callback_t)(void *handle, void *userData);
+
+/**
+ * @brief Like linkernsbypass_namespace_dlopen_unique_ext but copies, patches and loads the library on a background thread owned by the library, so it can overlap with other initialisation
+ * @note `info` and the strings and android_dlextinfo it points to are copied, but `stats` and `arena` are used as is and must stay valid until the load has finished
+ * @param libPath The path to the library to load with hooks applied
+ * @param flags The rtld flags for `libPath`
+ * @param ns The namespace to dlopen into
+ * @param info Options controlling how the unique instance is created
+ * @param callback Called with the result once the load has finished, may be nullptr if the result is only collected through the returned future
+ * @param userData Passed through to `callback`
+ * @return The pending load, this must be released with linkernsbypass_async_release once it's no longer needed, which doesn't need to wait for the load to finish
+ */
+struct linkernsbypass_async_t *linkernsbypass_namespace_dlopen_unique_async(const char *libPath, int flags, struct android_namespace_t *ns, const linkernsbypass_unique_info *info,
+                                                                          linkernsbypass_async_callback_t callback, void *userData);
+
+/**
+ * @brief Checks if an asynchronous load has finished without blocking
+ * @param handle Set to the handle of the loaded library (or nullptr if loading failed) if the load has finished, may be nullptr
+ * @return true if the load has finished
+ */
+bool linkernsbypass_async_poll(struct linkernsbypass_async_t *async, void **handle);
+
+/**
+ * @brief Blocks until an asynchronous load has finished
+ * @return The handle of the loaded library, or nullptr if loading failed
+ */
+void *linkernsbypass_async_wait(struct linkernsbypass_async_t *async);
+
+/**
+ * @brief Releases a pending load, the load itself still runs to completion (including calling its callback) if it hasn't finished yet
+ */
+void linkernsbypass_async_release(struct linkernsbypass_async_t *async);
+
+/**
+ * @brief Starts creating `count` soname patched copies of a library in the background, so later unique loads of it can skip straight to android_dlopen_ext
+ * @note The library is also read into the page cache ahead of time. Copies are memfds with the default ID width, so they are only used by loads with a null `target_dir`, an `id_width` of 0 or 3 and without the SEALED or HUGE_PAGES flags
+ * @note Each prewarmed copy holds a unique ID until it is used or released with linkernsbypass_prewarm_release
+ * @param libPath The path to the library, this must match the path later passed to the unique loads exactly
+ * @param count The number of copies to create
+ * @return false if the library couldn't be opened
+ */
+bool linkernsbypass_prewarm(const char *libPath, size_t count);
+
+/**
+ * @brief Releases the prewarmed copies of a library that haven't been used yet
+ * @note Copies that are still being created when this is called are added to the pool afterwards
+ * @param libPath The path to the library that was passed to linkernsbypass_prewarm, or nullptr to release every prewarmed copy
+ */
+void linkernsbypass_prewarm_release(const char *libPath);
+
+/**
+ * @brief Reads the accumulated stats of every unique load in the process so far
+ * @param stats Filled with the accumulated stats
+ */
+void linkernsbypass_get_unique_stats(linkernsbypass_unique_stats *stats);
+
+/**
+ * @brief Resets the process-wide unique load stats back to zero
+ */
+void linkernsbypass_reset_unique_stats();
+
+/**
+ * @brief A pristine in-memory copy of a library that unique instances can be cheaply created from
+ */
+struct linkernsbypass_template_t;
+
+/**
+ * @brief Creates a template from a library for repeatedly loading unique instances of it without going back to disk
+ * @note This requires memfd support
+ * @param libPath The path to the library to create a template of
+ * @return The template, or nullptr on failure
+ */
+struct linkernsbypass_template_t *linkernsbypass_template_create(const char *libPath);
+
+/**
+ * @brief Force loads a unique instance of the library held by a template into a namespace
+ * @note The instance is created with an in-memory copy of the template, which is much faster than linkernsbypass_namespace_dlopen_unique for repeated instances of the same library
+ * @param libTemplate The template of the library to load
+ * @param flags The rtld flags for the library
+ * @param ns The namespace to dlopen into
+ */
+void *linkernsbypass_namespace_dlopen_template(struct linkernsbypass_template_t *libTemplate, int flags, struct android_namespace_t *ns);
+
+/**
+ * @brief Destroys a template, instances that were loaded from it are unaffected
+ */
+void linkernsbypass_template_destroy(struct linkernsbypass_template_t *libTemplate);
+
+enum {
+  LINKERNSBYPASS_EVENT_NAMESPACE_CREATE = 1, //!< `ns` was created with the name `name`, it is nullptr if creation failed
+  LINKERNSBYPASS_EVENT_NAMESPACE_LINK = 2, //!< `ns` was linked to `linked_ns`, sharing the libraries in `name` or all of them if it's empty, `error` is -1 if linking failed
+  LINKERNSBYPASS_EVENT_LOAD = 3, //!< `name` was loaded into `ns` with linkernsbypass_namespace_dlopen_ext, `handle` is nullptr if loading failed
+  LINKERNSBYPASS_EVENT_UNIQUE_LOAD = 4, //!< A unique instance of `name` was loaded into `ns`, `handle` is nullptr if loading failed
+  LINKERNSBYPASS_EVENT_UNIQUE_UNLOAD = 5, //!< The last reference to the unique instance `handle` was dropped, `error` is -1 if dlclose failed
+  LINKERNSBYPASS_EVENT_FAILURE = 6, //!< `call` failed with `error` while working on `name`, this is usually followed by the event of the operation that failed because of it from the same thread
+};
+
+enum {
+  LINKERNSBYPASS_EVENT_TARGET_NONE = 0, //!< The library was loaded as is
+  LINKERNSBYPASS_EVENT_TARGET_MEMFD = 1, //!< The patched copy was a memfd
+  LINKERNSBYPASS_EVENT_TARGET_FILE = 2, //!< The patched copy was a file in `target_dir`
+  LINKERNSBYPASS_EVENT_TARGET_CACHE = 3, //!< The patched copy came from the persistent cache
+  LINKERNSBYPASS_EVENT_TARGET_PREWARMED = 4, //!< The patched copy came from the prewarmed pool
+  LINKERNSBYPASS_EVENT_TARGET_DIRECT = 5, //!< No copy was needed, with LINKERNSBYPASS_UNIQUE_IF_NEEDED
+  LINKERNSBYPASS_EVENT_TARGET_PREPATCHED = 6, //!< The library was a variant pre-patched by elf_soname_prepatch
+};
+
+enum {
+  LINKERNSBYPASS_EVENT_CALL_NONE = 0,
+  LINKERNSBYPASS_EVENT_CALL_OPEN = 1, //!< Opening the source library or creating a file to hold the copy
+  LINKERNSBYPASS_EVENT_CALL_MEMFD_CREATE = 2,
+  LINKERNSBYPASS_EVENT_CALL_READ = 3, //!< Reading the ELF headers of the source library, `error` is 0 if it isn't a valid ELF with a soname
+  LINKERNSBYPASS_EVENT_CALL_COPY = 4, //!< Sizing the copy with ftruncate and copying the source library into it
+  LINKERNSBYPASS_EVENT_CALL_WRITE = 5, //!< Writing the soname patch into the copy
+  LINKERNSBYPASS_EVENT_CALL_SEAL = 6,
+  LINKERNSBYPASS_EVENT_CALL_MMAP = 7, //!< Reserving address space
+  LINKERNSBYPASS_EVENT_CALL_ALLOCATE_ID = 8, //!< Every unique ID, or arena slot, is in use
+};
+
+/**
+ * @brief A single entry in the load event log, this is a fixed size binary record so it can be written out as is
+ */
+typedef struct {
+  uint64_t sequence; //!< The position of the event in the log, this starts at 1 and increases by one for every event recorded
+  uint64_t timestamp_ns; //!< The CLOCK_MONOTONIC time when the event was recorded, after the operation it describes finished
+  uint64_t duration_ns; //!< How long the operation took, 0 for failures
+  uint64_t thread; //!< The pthread_t of the thread that recorded the event
+  const void *ns; //!< The namespace the event concerns, if any
+  const void *handle; //!< The dlopen handle the event concerns, if any
+  const void *linked_ns; //!< The namespace that `ns` was linked to
+  int64_t unique_id; //!< The unique ID of the instance, -1 if it had none
+  uint32_t type; //!< LINKERNSBYPASS_EVENT_*
+  uint32_t target; //!< LINKERNSBYPASS_EVENT_TARGET_* for loads
+  uint32_t call; //!< LINKERNSBYPASS_EVENT_CALL_* for failures
+  int32_t error; //!< The errno of the failure, 0 if there was none
+  char name[64]; //!< The end of the path of the library or the name of the namespace, truncated from the start to fit
+} linkernsbypass_event;
+
+/**
+ * @brief Copies the newest events from the load event log, which holds the last 256 events in the process
+ * @note Recording events is lock-free and never allocates or makes syscalls, so the log is always enabled. Events that are overwritten while being copied are skipped, as are events dropped because a writer a whole lap ahead of or behind them raced them for their slot, both show as a gap in `sequence`
+ * @param events Filled with up to `count` events, oldest first
+ * @return The number of events copied
+ */
+size_t linkernsbypass_get_events(linkernsbypass_event *events, size_t count);
+
+/**
+ * @brief Writes every event in the load event log to `fd` as an array of linkernsbypass_event records, oldest first
+ * @return If every event was written
+ */
+bool linkernsbypass_dump_events(int fd);
+
 #ifdef __cplusplus
 }
+
+#include <array>
+#include <cstring>
+#include <type_traits>
+
+/**
+ * @brief Fills a struct made up entirely of function pointers with linkernsbypass_dlsym_bulk, `names` gives the symbol for each member in declaration order
+ * @return true if every member was resolved, members that couldn't be are set to nullptr
+ */
+template<typename Table, size_t Count>
+bool linkernsbypass_dlsym_table(void *handle, Table &table, const char *const (&names)[Count]) {
+    static_assert(std::is_trivially_copyable_v<Table> && sizeof(Table) == Count * sizeof(void *), "The table must consist of exactly one pointer for each name");
+
+    std::array<void *, Count> addresses{};
+    bool resolvedAll{linkernsbypass_dlsym_bulk(handle, names, Count, addresses.data()) == Count};
+    std::memcpy(&table, addresses.data(), sizeof(Table));
+    return resolvedAll;
+}
 #endif
@@ -0,0 +1,109 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright © 2021 Billy Laws
+
+// Measures the throughput of each stage of the soname patcher, this builds and runs on Linux hosts as well as on devices
+
+#include <algorithm>
+#include <chrono>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <elf_soname_patcher.h>
+
+namespace {
+    using Clock = std::chrono::steady_clock;
+
+    int create_memfd(const char *name) {
+        return static_cast<int>(syscall(__NR_memfd_create, name, 0));
+    }
+
+    /**
+     * @brief Runs `func` `iterations` times and prints the median latency along with the throughput that corresponds to for a file of `size` bytes
+     */
+    void report(const char *name, size_t iterations, uint64_t size, const std::function<bool()> &func) {
+        std::vector<double> samples;
+        for (size_t i{}; i < iterations; i++) {
+            auto start{Clock::now()};
+            if (!func()) {
+                printf("  %-18s failed: %s\n", name, strerror(errno));
+                return;
+            }
+            samples.push_back(std::chrono::duration<double, std::micro>(Clock::now() - start).count());
+        }
+
+        std::sort(samples.begin(), samples.end());
+        double median{samples[samples.size() / 2]};
+        printf("  %-18s min=%9.1fus p50=%9.1fus max=%9.1fus %9.1f MiB/s\n",
+               name, samples.front(), median, samples.back(), static_cast<double>(size) / (1024.0 * 1024.0) / (median / 1e6));
+    }
+
+    void bench_lib(const char *lib, size_t iterations) {
+        int libFd{open(lib, O_RDONLY | O_CLOEXEC)};
+        elf_soname_location location{};
+        if (libFd == -1 || !elf_soname_locate(libFd, &location)) {
+            fprintf(stderr, "Skipping %s: not a readable elf with a soname\n", lib);
+            if (libFd != -1)
+                close(libFd);
+            return;
+        }
+
+        int targetFd{create_memfd("elf_soname_patcher_bench")};
+        if (targetFd == -1) {
+            fprintf(stderr, "Failed to create a memfd: %s\n", strerror(errno));
+            close(libFd);
+            return;
+        }
+
+        printf("%s (%llu KiB)\n", lib, static_cast<unsigned long long>(location.size / 1024));
+
+        report("elf_soname_locate", iterations, location.size, [&]() {
+            elf_soname_location scratch{};
+            return elf_soname_locate(libFd, &scratch);
+        });
+
+        report("elf_copy_file", iterations, location.size, [&]() {
+            return elf_copy_file(libFd, targetFd, location.size);
+        });
+
+        report("elf_soname_write", iterations, location.size, [&]() {
+            return elf_soname_write(targetFd, &location, "000");
+        });
+
+        report("elf_soname_patch", iterations, location.size, [&]() {
+            return elf_soname_patch(lib, targetFd, "000");
+        });
+
+        close(targetFd);
+        close(libFd);
+    }
+}
+
+int main(int argc, char **argv) {
+    size_t iterations{50};
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:h")) != -1) {
+        if (opt == 'n') {
+            iterations = std::max(1UL, strtoul(optarg, nullptr, 10));
+        } else {
+            fprintf(stderr, "Usage: %s [-n iterations] library...\n", argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (optind >= argc) {
+        fprintf(stderr, "Usage: %s [-n iterations] library...\n", argv[0]);
+        return 1;
+    }
+
+    for (int i{optind}; i < argc; i++)
+        bench_lib(argv[i], iterations);
+
+    return 0;
+}
@@ -0,0 +1,247 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright © 2021 Billy Laws
+
+// Benchmarks patching and loading latency, intended to be pushed to a device and run through `adb shell`
+
+#include <algorithm>
+#include <chrono>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <vector>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <android_linker_ns.h>
+#include <elf_soname_patcher.h>
+
+namespace {
+    struct Options {
+        size_t iterations{20};
+        size_t instances{16};
+        const char *targetDir{"/data/local/tmp"};
+        std::vector<const char *> libs;
+    };
+
+    using Clock = std::chrono::steady_clock;
+
+    double elapsed_us(Clock::time_point start) {
+        return std::chrono::duration<double, std::micro>(Clock::now() - start).count();
+    }
+
+    void report(const char *name, const char *lib, std::vector<double> samples) {
+        if (samples.empty()) {
+            printf("%-28s %-40s failed\n", name, lib);
+            return;
+        }
+
+        std::sort(samples.begin(), samples.end());
+        auto percentile{[&](double p) {
+            return samples[static_cast<size_t>(p * static_cast<double>(samples.size() - 1) + 0.5)];
+        }};
+
+        printf("%-28s %-40s n=%-4zu min=%9.1f p50=%9.1f p90=%9.1f p99=%9.1f max=%9.1f (us)\n",
+               name, lib, samples.size(), samples.front(), percentile(0.5), percentile(0.9), percentile(0.99), samples.back());
+    }
+
+    // Drops the source library from the page cache so the next run has to read it from storage
+    void evict_page_cache(const char *path) {
+        int fd{open(path, O_RDONLY | O_CLOEXEC)};
+        if (fd == -1)
+            return;
+
+        fdatasync(fd);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+
+    int create_memfd(const char *name) {
+        return static_cast<int>(syscall(__NR_memfd_create, name, 0));
+    }
+
+    /**
+     * @brief Runs `func` for each iteration, optionally evicting `lib` from the page cache before each one
+     */
+    std::vector<double> measure(const Options &options, const char *lib, bool cold, const std::function<bool()> &func) {
+        std::vector<double> samples;
+        for (size_t i{}; i < options.iterations; i++) {
+            if (cold)
+                evict_page_cache(lib);
+
+            auto start{Clock::now()};
+            if (!func())
+                return {};
+            samples.push_back(elapsed_us(start));
+        }
+        return samples;
+    }
+
+    void bench_patch(const Options &options, const char *lib) {
+        for (bool cold : {false, true}) {
+            report(cold ? "elf_soname_patch (cold)" : "elf_soname_patch (warm)", lib, measure(options, lib, cold, [&]() {
+                int fd{create_memfd("bench_patch")};
+                bool patched{fd != -1 && elf_soname_patch(lib, fd, "000")};
+                close(fd);
+                return patched;
+            }));
+        }
+    }
+
+    void bench_unique(const Options &options, const char *lib, android_namespace_t *ns) {
+        // Each instance is unloaded once every iteration has been measured, which deletes the copies written to `targetDir` and frees their IDs
+        auto measureUnique{[&](bool cold, const char *targetDir) {
+            linkernsbypass_unique_info info{};
+            info.target_dir = targetDir;
+            std::vector<linkernsbypass_unique_t *> loaded;
+            auto samples{measure(options, lib, cold, [&]() {
+                auto instance{linkernsbypass_namespace_dlopen_unique_handle(lib, RTLD_NOW | RTLD_LOCAL, ns, &info)};
+                if (instance)
+                    loaded.push_back(instance);
+                return instance != nullptr;
+            })};
+
+            for (auto instance : loaded)
+                linkernsbypass_unique_unload(instance);
+            return samples;
+        }};
+
+        for (bool cold : {false, true}) {
+            report(cold ? "dlopen_unique memfd (cold)" : "dlopen_unique memfd (warm)", lib, measureUnique(cold, nullptr));
+            report(cold ? "dlopen_unique dir (cold)" : "dlopen_unique dir (warm)", lib, measureUnique(cold, options.targetDir));
+        }
+
+        // Every instance stays loaded until the end so this shows how the cost grows as the namespace fills up
+        linkernsbypass_unique_info info{};
+        std::vector<linkernsbypass_unique_t *> instances;
+        std::vector<double> instanceSamples, unloadSamples;
+        for (size_t i{}; i < options.instances; i++) {
+            auto start{Clock::now()};
+            auto instance{linkernsbypass_namespace_dlopen_unique_handle(lib, RTLD_NOW | RTLD_LOCAL, ns, &info)};
+            if (!instance)
+                break;
+            instanceSamples.push_back(elapsed_us(start));
+            instances.push_back(instance);
+        }
+        report("dlopen_unique N instances", lib, instanceSamples);
+
+        for (auto instance : instances) {
+            auto start{Clock::now()};
+            linkernsbypass_unique_unload(instance);
+            unloadSamples.push_back(elapsed_us(start));
+        }
+        report("unique_unload", lib, unloadSamples);
+
+        auto libTemplate{linkernsbypass_template_create(lib)};
+        report("dlopen_template", lib, libTemplate ? measure(options, lib, false, [&]() {
+            return linkernsbypass_namespace_dlopen_template(libTemplate, RTLD_NOW | RTLD_LOCAL, ns) != nullptr;
+        }) : std::vector<double>{});
+        linkernsbypass_template_destroy(libTemplate);
+    }
+
+    /**
+     * @brief Measures the one-time cost of resolving the linker symbols, each sample is taken in a fresh child process since it only happens once per process
+     */
+    void bench_init(const Options &options) {
+        std::vector<double> samples;
+        for (size_t i{}; i < options.iterations; i++) {
+            int pipeFds[2];
+            if (pipe(pipeFds))
+                break;
+
+            pid_t pid{fork()};
+            if (pid == 0) {
+                auto start{Clock::now()};
+                bool loaded{linkernsbypass_load_status()};
+                double sample{loaded ? elapsed_us(start) : -1.0};
+                write(pipeFds[1], &sample, sizeof(sample));
+                _exit(0);
+            }
+
+            close(pipeFds[1]);
+            double sample{-1.0};
+            bool readSample{pid != -1 && read(pipeFds[0], &sample, sizeof(sample)) == sizeof(sample)};
+            close(pipeFds[0]);
+            if (pid != -1)
+                waitpid(pid, nullptr, 0);
+
+            if (!readSample || sample < 0)
+                break;
+            samples.push_back(sample);
+        }
+
+        report("linkernsbypass_load_status", "(init)", samples);
+    }
+
+    void usage(const char *argv0) {
+        fprintf(stderr, "Usage: %s [-n iterations] [-i instances] [-d target dir] [library...]\n", argv0);
+    }
+}
+
+int main(int argc, char **argv) {
+    Options options{};
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:i:d:h")) != -1) {
+        switch (opt) {
+            case 'n':
+                options.iterations = std::max(1UL, strtoul(optarg, nullptr, 10));
+                break;
+            case 'i':
+                options.instances = strtoul(optarg, nullptr, 10);
+                break;
+            case 'd':
+                options.targetDir = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    for (int i{optind}; i < argc; i++)
+        options.libs.push_back(argv[i]);
+
+    // A spread of library sizes that are present on every device
+    if (options.libs.empty())
+        options.libs = {"/system/lib64/libEGL.so", "/system/lib64/libvulkan.so", "/system/lib64/libc++.so", "/system/lib64/libandroid_runtime.so"};
+
+    // Measured first as it must run in processes that haven't initialised the library yet
+    bench_init(options);
+
+    if (!linkernsbypass_load_status()) {
+        fprintf(stderr, "linkernsbypass failed to load\n");
+        return 1;
+    }
+
+    auto ns{android_create_namespace("linkernsbypass_bench", nullptr, nullptr, ANDROID_NAMESPACE_TYPE_SHARED, nullptr, nullptr)};
+    if (!ns || !linkernsbypass_link_namespace_to_default_all_libs(ns)) {
+        fprintf(stderr, "Failed to create the benchmark namespace\n");
+        return 1;
+    }
+
+    for (auto lib : options.libs) {
+        struct stat libStat{};
+        if (stat(lib, &libStat)) {
+            fprintf(stderr, "Skipping %s: %s\n", lib, strerror(errno));
+            continue;
+        }
+
+        printf("%s (%lld KiB)\n", lib, static_cast<long long>(libStat.st_size / 1024));
+        bench_patch(options, lib);
+        bench_unique(options, lib, ns);
+    }
+
+    linkernsbypass_unique_stats stats{};
+    linkernsbypass_get_unique_stats(&stats);
+    printf("Totals: loads=%llu parse=%.1fms copy=%.1fms patch=%.1fms dlopen=%.1fms copied=%lluKiB faults=%llu/%llu\n",
+           static_cast<unsigned long long>(stats.loads), stats.parse_ns / 1e6, stats.copy_ns / 1e6, stats.patch_ns / 1e6, stats.dlopen_ns / 1e6,
+           static_cast<unsigned long long>(stats.bytes_copied / 1024), static_cast<unsigned long long>(stats.minor_faults), static_cast<unsigned long long>(stats.major_faults));
+
+    return 0;
+}
@@ -2,66 +2,346 @@
 // Copyright © 2021 Billy Laws
 
 #include <initializer_list>
+#include <algorithm>
+#include <array>
+#include <memory>
+#include <utility>
+#include <vector>
 #include <cstdint>
+#include <cstring>
 #include <errno.h>
 #include <sys/stat.h>
-#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <link.h>
 #include <elf.h>
 #include "elf_soname_patcher.h"
 
-bool elf_soname_patch(const char *libPath, int targetFd, const char *sonamePatch) {
-    struct stat libStat{};
-    if (stat(libPath, &libStat))
+#ifndef __NR_copy_file_range
+    #if defined(__aarch64__)
+        #define __NR_copy_file_range 285
+    #else
+        #error Unsupported target architecture!
+    #endif
+#endif
+
+// Bionic only exposes copy_file_range from API 34 so go through the syscall directly
+static ssize_t copy_file_range_compat(int srcFd, loff_t *srcOffset, int targetFd, loff_t *targetOffset, size_t length) {
+    return static_cast<ssize_t>(syscall(__NR_copy_file_range, srcFd, srcOffset, targetFd, targetOffset, length, 0));
+}
+
+// Errors that mean the copy method isn't usable for this pair of files, rather than an actual I/O failure
+static bool copy_method_unsupported(int error) {
+    return error == ENOSYS || error == EXDEV || error == EINVAL || error == EOPNOTSUPP || error == EBADF || error == ETXTBSY;
+}
+
+bool elf_copy_file(int srcFd, int targetFd, uint64_t size) {
+    if (ftruncate(targetFd, 0) == -1)
         return false;
 
-    if (ftruncate(targetFd, libStat.st_size) == -1)
+    // Reflinks share the underlying extents and are practically free when libTargetDir is on a filesystem that supports them (btrfs, f2fs, xfs)
+    if (ioctl(targetFd, FICLONE, srcFd) == 0)
+        return true;
+
+    uint64_t copied{};
+
+    // Partial progress is kept between methods so falling back halfway through a copy is fine
+    auto copyWithKernel{[&]() {
+        while (copied < size) {
+            loff_t srcOffset{static_cast<loff_t>(copied)}, targetOffset{static_cast<loff_t>(copied)};
+            ssize_t ret{copy_file_range_compat(srcFd, &srcOffset, targetFd, &targetOffset, size - copied)};
+            if (ret == 0)
+                errno = EOPNOTSUPP; // Some filesystems report EOF rather than failing when they can't copy directly
+            if (ret <= 0)
+                return false;
+            copied += static_cast<uint64_t>(ret);
+        }
+        return true;
+    }};
+
+    auto copyWithSendfile{[&]() {
+        // sendfile always writes at the current target offset
+        if (lseek(targetFd, static_cast<off_t>(copied), SEEK_SET) == -1)
+            return false;
+
+        while (copied < size) {
+            off_t srcOffset{static_cast<off_t>(copied)};
+            ssize_t ret{sendfile(targetFd, srcFd, &srcOffset, size - copied)};
+            if (ret == 0)
+                errno = EOPNOTSUPP; // Some filesystems report EOF rather than failing when they can't copy directly
+            if (ret <= 0)
+                return false;
+            copied += static_cast<uint64_t>(ret);
+        }
+        return true;
+    }};
+
+    auto copyWithBuffer{[&]() {
+        constexpr size_t ChunkSize{1024 * 1024};
+        auto buffer{std::make_unique<uint8_t[]>(ChunkSize)};
+
+        while (copied < size) {
+            ssize_t readRet{pread(srcFd, buffer.get(), std::min<uint64_t>(ChunkSize, size - copied), static_cast<off_t>(copied))};
+            if (readRet <= 0)
+                return false;
+
+            for (ssize_t written{}; written < readRet;) {
+                ssize_t writeRet{pwrite(targetFd, buffer.get() + written, static_cast<size_t>(readRet - written), static_cast<off_t>(copied) + written)};
+                if (writeRet <= 0)
+                    return false;
+                written += writeRet;
+            }
+            copied += static_cast<uint64_t>(readRet);
+        }
+        return true;
+    }};
+
+    if (copyWithKernel())
+        return true;
+    else if (!copy_method_unsupported(errno))
         return false;
 
-    // Map the memory so we can read our elf into it
-    auto mappedLib{reinterpret_cast<uint8_t *>(mmap(nullptr, libStat.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, targetFd, 0))};
-    if (!mappedLib)
+    if (copyWithSendfile())
+        return true;
+    else if (!copy_method_unsupported(errno))
         return false;
 
-    int libFd{open(libPath, O_RDONLY)};
-    if (libFd == false)
+    return copyWithBuffer();
+}
+
+template<typename T>
+static bool pread_exact(int fd, T *out, size_t count, uint64_t offset) {
+    auto size{sizeof(T) * count};
+    return pread(fd, out, size, static_cast<off_t>(offset)) == static_cast<ssize_t>(size);
+}
+
+namespace {
+    struct DynamicInfo {
+        std::vector<ElfW(Dyn)> entries; //!< The contents of .dynamic
+        uint64_t strTabOffset{}; //!< File offset of .dynstr
+        uint64_t strTabSize{}; //!< Size of .dynstr, this is 0 if the size is unknown
+    };
+}
+
+/**
+ * @brief Reads the dynamic section of an elf using a few small preads, preferring program headers over section headers so stripped libraries work too
+ */
+static bool read_dynamic_info(int elfFd, uint64_t elfSize, DynamicInfo &info) {
+    ElfW(Ehdr) eHdr{};
+    if (elfSize < sizeof(eHdr) || !pread_exact(elfFd, &eHdr, 1, 0))
         return false;
 
-    // Read lib elf into target file
-    if (read(libFd, mappedLib, libStat.st_size) != libStat.st_size)
+    if (memcmp(eHdr.e_ident, ELFMAG, SELFMAG) != 0 || eHdr.e_ident[EI_CLASS] != (sizeof(ElfW(Addr)) == 8 ? ELFCLASS64 : ELFCLASS32))
         return false;
 
-    // No longer needed
-    close(libFd);
+    auto inBounds{[elfSize](uint64_t offset, uint64_t size) {
+        return offset <= elfSize && size <= elfSize - offset;
+    }};
+
+    auto readEntries{[&](uint64_t offset, uint64_t size) {
+        auto count{size / sizeof(ElfW(Dyn))};
+        if (!count || !inBounds(offset, size))
+            return false;
 
-    auto eHdr{reinterpret_cast<ElfW(Ehdr) *>(mappedLib)};
-    auto sHdrEntries{reinterpret_cast<ElfW(Shdr) *>(mappedLib + eHdr->e_shoff)};
+        info.entries.resize(count);
+        return pread_exact(elfFd, info.entries.data(), count, offset);
+    }};
 
-    // Iterate over section headers to find the .dynamic section
-    for (ElfW(Half) i{}; i < eHdr->e_shnum; i++) {
-        auto &sHdr{sHdrEntries[i]};
-        if (sHdr.sh_type == SHT_DYNAMIC) {
-            auto strTab{reinterpret_cast<char *>(mappedLib + sHdrEntries[sHdr.sh_link].sh_offset)};
-            auto dynHdrEntries{reinterpret_cast<ElfW(Dyn) *>(mappedLib + sHdr.sh_offset)};
+    auto findEntry{[&](ElfW(Sxword) tag) -> const ElfW(Dyn) * {
+        for (auto &entry : info.entries) {
+            if (entry.d_tag == DT_NULL)
+                break;
+            else if (entry.d_tag == tag)
+                return &entry;
+        }
+        return nullptr;
+    }};
 
-            // Iterate over .dynamic entries to find DT_SONAME
-            for (ElfW(Xword) k{}; k < (sHdr.sh_size / sHdr.sh_entsize); k++) {
-                auto &dynHdrEntry{dynHdrEntries[k]};
-                if (dynHdrEntry.d_tag == DT_SONAME) {
-                    char *soname{strTab + dynHdrEntry.d_un.d_val};
+    if (eHdr.e_phnum && eHdr.e_phentsize == sizeof(ElfW(Phdr)) && inBounds(eHdr.e_phoff, eHdr.e_phnum * sizeof(ElfW(Phdr)))) {
+        std::vector<ElfW(Phdr)> pHdrs(eHdr.e_phnum);
+        if (!pread_exact(elfFd, pHdrs.data(), pHdrs.size(), eHdr.e_phoff))
+            return false;
 
-                    // Partially replace the old soname with the soname patch
-                    size_t charIdx{};
-                    for (; soname[charIdx] != 0 && sonamePatch[charIdx] != 0; charIdx++)
-                        soname[charIdx] = sonamePatch[charIdx];
+        auto dynamicHdr{std::find_if(pHdrs.begin(), pHdrs.end(), [](const ElfW(Phdr) &pHdr) { return pHdr.p_type == PT_DYNAMIC; })};
+        if (dynamicHdr != pHdrs.end() && readEntries(dynamicHdr->p_offset, dynamicHdr->p_filesz)) {
+            auto strTab{findEntry(DT_STRTAB)};
+            auto strSz{findEntry(DT_STRSZ)};
 
+            // DT_STRTAB holds a virtual address so find the loadable segment that contains it to get the file offset
+            for (auto &pHdr : pHdrs) {
+                if (strTab && pHdr.p_type == PT_LOAD && strTab->d_un.d_ptr >= pHdr.p_vaddr && strTab->d_un.d_ptr - pHdr.p_vaddr < pHdr.p_filesz) {
+                    info.strTabOffset = pHdr.p_offset + (strTab->d_un.d_ptr - pHdr.p_vaddr);
+                    info.strTabSize = strSz ? strSz->d_un.d_val : 0;
                     return true;
                 }
             }
         }
     }
 
+    // Fall back to the section headers for anything without a usable PT_DYNAMIC
+    if (!eHdr.e_shnum || eHdr.e_shentsize != sizeof(ElfW(Shdr)) || !inBounds(eHdr.e_shoff, eHdr.e_shnum * sizeof(ElfW(Shdr))))
+        return false;
+
+    std::vector<ElfW(Shdr)> sHdrs(eHdr.e_shnum);
+    if (!pread_exact(elfFd, sHdrs.data(), sHdrs.size(), eHdr.e_shoff))
+        return false;
+
+    for (auto &sHdr : sHdrs) {
+        if (sHdr.sh_type == SHT_DYNAMIC && sHdr.sh_link < sHdrs.size() && readEntries(sHdr.sh_offset, sHdr.sh_size)) {
+            info.strTabOffset = sHdrs[sHdr.sh_link].sh_offset;
+            info.strTabSize = sHdrs[sHdr.sh_link].sh_size;
+            return true;
+        }
+    }
+
     return false;
 }
+
+/**
+ * @brief Finds the length of the string at `offset` in .dynstr without reading past the end of the table or the file
+ */
+static bool read_string_length(int elfFd, uint64_t elfSize, const DynamicInfo &info, uint64_t offset, uint64_t &length) {
+    uint64_t strOffset{info.strTabOffset + offset};
+    uint64_t strEnd{info.strTabSize ? std::min(info.strTabOffset + info.strTabSize, elfSize) : elfSize};
+    if (strOffset >= strEnd)
+        return false;
+
+    // Sonames are never anywhere near this long
+    std::array<char, 256> buffer{};
+    auto readSize{static_cast<size_t>(std::min<uint64_t>(buffer.size(), strEnd - strOffset))};
+    if (!pread_exact(elfFd, buffer.data(), readSize, strOffset))
+        return false;
+
+    auto terminator{std::find(buffer.begin(), buffer.begin() + readSize, '\0')};
+    if (terminator == buffer.begin() + readSize)
+        return false;
+
+    length = static_cast<uint64_t>(terminator - buffer.begin());
+    return true;
+}
+
+bool elf_soname_locate(int elfFd, elf_soname_location *location) {
+    struct stat elfStat{};
+    if (fstat(elfFd, &elfStat))
+        return false;
+
+    auto elfSize{static_cast<uint64_t>(elfStat.st_size)};
+
+    DynamicInfo info{};
+    if (!read_dynamic_info(elfFd, elfSize, info))
+        return false;
+
+    for (auto &entry : info.entries) {
+        if (entry.d_tag == DT_NULL) {
+            break;
+        } else if (entry.d_tag == DT_SONAME) {
+            if (!read_string_length(elfFd, elfSize, info, entry.d_un.d_val, location->length))
+                return false;
+
+            location->offset = info.strTabOffset + entry.d_un.d_val;
+            location->size = elfSize;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool elf_needed_locate(int elfFd, elf_soname_location *needed, size_t *count) {
+    struct stat elfStat{};
+    if (fstat(elfFd, &elfStat))
+        return false;
+
+    auto elfSize{static_cast<uint64_t>(elfStat.st_size)};
+
+    DynamicInfo info{};
+    if (!read_dynamic_info(elfFd, elfSize, info))
+        return false;
+
+    size_t found{};
+    for (auto &entry : info.entries) {
+        if (entry.d_tag == DT_NULL)
+            break;
+        else if (entry.d_tag != DT_NEEDED)
+            continue;
+
+        if (found < *count) {
+            if (!read_string_length(elfFd, elfSize, info, entry.d_un.d_val, needed[found].length))
+                return false;
+
+            needed[found].offset = info.strTabOffset + entry.d_un.d_val;
+            needed[found].size = elfSize;
+        }
+        found++;
+    }
+
+    *count = found;
+    return true;
+}
+
+bool elf_load_layout_read(int elfFd, elf_load_layout *layout) {
+    ElfW(Ehdr) eHdr{};
+    if (!pread_exact(elfFd, &eHdr, 1, 0))
+        return false;
+
+    if (memcmp(eHdr.e_ident, ELFMAG, SELFMAG) != 0 || eHdr.e_ident[EI_CLASS] != (sizeof(ElfW(Addr)) == 8 ? ELFCLASS64 : ELFCLASS32))
+        return false;
+
+    if (!eHdr.e_phnum || eHdr.e_phentsize != sizeof(ElfW(Phdr)))
+        return false;
+
+    std::vector<ElfW(Phdr)> pHdrs(eHdr.e_phnum);
+    if (!pread_exact(elfFd, pHdrs.data(), pHdrs.size(), eHdr.e_phoff))
+        return false;
+
+    // Matches how the linker sizes the reservation for an elf (phdr_table_get_load_size)
+    auto pageSize{static_cast<uint64_t>(sysconf(_SC_PAGESIZE))};
+    uint64_t minVaddr{UINT64_MAX}, maxVaddr{};
+    const ElfW(Phdr) *textHdr{};
+    for (auto &pHdr : pHdrs) {
+        if (pHdr.p_type != PT_LOAD)
+            continue;
+
+        minVaddr = std::min<uint64_t>(minVaddr, pHdr.p_vaddr);
+        maxVaddr = std::max<uint64_t>(maxVaddr, pHdr.p_vaddr + pHdr.p_memsz);
+        if ((pHdr.p_flags & PF_X) && (!textHdr || pHdr.p_filesz > textHdr->p_filesz))
+            textHdr = &pHdr;
+    }
+
+    if (!textHdr)
+        return false;
+
+    minVaddr &= ~(pageSize - 1);
+    maxVaddr = (maxVaddr + pageSize - 1) & ~(pageSize - 1);
+
+    *layout = {
+        .load_size = maxVaddr - minVaddr,
+        .text_offset = textHdr->p_offset,
+        .text_vaddr = textHdr->p_vaddr - minVaddr,
+        .text_size = textHdr->p_filesz
+    };
+    return true;
+}
+
+bool elf_soname_write(int targetFd, const elf_soname_location *location, const char *sonamePatch) {
+    // Only partially replace the old soname with the soname patch
+    auto patchLength{static_cast<size_t>(std::min<uint64_t>(strlen(sonamePatch), location->length))};
+    return pwrite(targetFd, sonamePatch, patchLength, static_cast<off_t>(location->offset)) == static_cast<ssize_t>(patchLength);
+}
+
+bool elf_soname_patch(const char *libPath, int targetFd, const char *sonamePatch) {
+    int libFd{open(libPath, O_RDONLY | O_CLOEXEC)};
+    if (libFd == -1)
+        return false;
+
+    // Only the page holding the soname is touched in the target
+    elf_soname_location location{};
+    bool patched{elf_soname_locate(libFd, &location) && elf_copy_file(libFd, targetFd, location.size) && elf_soname_write(targetFd, &location, sonamePatch)};
+
+    close(libFd);
+    return patched;
+}
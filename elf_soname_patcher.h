@@ -7,8 +7,70 @@
 extern "C" {
 #endif
 
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief  Copies the contents of `srcFd` into `targetFd` using the cheapest method available
+ * @note   Tries a reflink first, then copy_file_range and sendfile, falling back to a chunked pread/pwrite copy if the kernel can't copy the files directly
+ * @param  srcFd FD of the file to copy from
+ * @param  targetFd FD of the file to copy into, this will be truncated to `size`
+ * @param  size The number of bytes to copy
+ * @return True on success
+ */
+bool elf_copy_file(int srcFd, int targetFd, uint64_t size);
+
+typedef struct {
+  uint64_t offset; //!< File offset of the soname string in .dynstr
+  uint64_t length; //!< Length of the soname, excluding the null terminator
+  uint64_t size; //!< Size of the elf file
+} elf_soname_location;
+
+/**
+ * @brief  Locates the soname of an elf with a handful of small reads, without reading the rest of the file
+ * @note   PT_DYNAMIC is preferred so this works for libraries with stripped section headers
+ * @note   Only the source elf is read, so this can run alongside copying it
+ * @param  elfFd FD of the elf to inspect
+ * @param  location Filled with the location of the soname on success
+ * @return True on success
+ */
+bool elf_soname_locate(int elfFd, elf_soname_location *location);
+
+/**
+ * @brief  Locates the DT_NEEDED strings of an elf in the same way as elf_soname_locate
+ * @param  elfFd FD of the elf to inspect
+ * @param  needed Filled with the locations of up to `*count` DT_NEEDED strings in the order they appear in .dynamic, may be nullptr if `*count` is 0
+ * @param  count The capacity of `needed`, this is set to the total number of DT_NEEDED entries on success which may be larger
+ * @return True on success
+ */
+bool elf_needed_locate(int elfFd, elf_soname_location *needed, size_t *count);
+
+typedef struct {
+  uint64_t load_size; //!< The page aligned span of every PT_LOAD segment, this is the amount of address space the linker reserves for the elf
+  uint64_t text_offset; //!< File offset of the largest executable PT_LOAD segment
+  uint64_t text_vaddr; //!< Address of the largest executable PT_LOAD segment relative to the start of the reserved address space
+  uint64_t text_size; //!< File size of the largest executable PT_LOAD segment
+} elf_load_layout;
+
+/**
+ * @brief  Reads how an elf will be laid out in memory once loaded from its program headers
+ * @param  elfFd FD of the elf to inspect
+ * @param  layout Filled with the layout of the elf on success
+ * @return True on success, false if the elf couldn't be read or has no executable PT_LOAD segment
+ */
+bool elf_load_layout_read(int elfFd, elf_load_layout *layout);
+
+/**
+ * @brief  Overwrites the first strlen(sonamePatch) chars of the soname at `location` in a copy of the elf
+ * @note   This must only be issued once the copy has completed, as copying truncates and overwrites the whole of `targetFd`; it then only touches the page holding the soname
+ * @param  targetFd FD of the copy of the elf to patch
+ * @param  location The location of the soname as returned by elf_soname_locate for the original elf
+ * @return True on success
+ */
+bool elf_soname_write(int targetFd, const elf_soname_location *location, const char *sonamePatch);
+
 /**
- * @brief  Overwrites a portion of the soname in an elf by loading it into shared memory and modifying .dynstr
+ * @brief  Copies an elf into `targetFd` and overwrites a portion of the soname in .dynstr of the copy
  * @note   IMPORTANT: The supplied soname patch will overwrite the first strlen(sonamePatch) chars of the soname
  * @param  elfPath Full path to the elf to patch
  * @param  targetFd FD to use for storing the patched library
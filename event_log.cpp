@@ -0,0 +1,125 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright © 2021 Billy Laws
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstring>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include "event_log.h"
+
+namespace {
+    constexpr size_t EventCapacity{256}; //!< The number of events kept in the log, this must be a power of two
+    constexpr uint64_t SlotWriting{UINT64_MAX}; //!< The sequence of a slot that a writer has claimed, which is never a valid sequence
+    constexpr size_t EventWords{sizeof(linkernsbypass_event) / sizeof(uint64_t)};
+    static_assert(sizeof(linkernsbypass_event) % sizeof(uint64_t) == 0, "Events are copied in and out of the log a word at a time");
+
+    /**
+     * @brief A slot in the ring buffer, this is a seqlock around the words of the event so readers never see a partially written one
+     * @note The words are atomics so concurrent reads and writes are well defined, they're only ever accessed with relaxed ordering which compiles to plain loads and stores
+     */
+    struct EventSlot {
+        std::atomic<uint64_t> sequence; //!< The sequence of the event in the slot, 0 if it has never been written or SlotWriting while it's being written
+        std::array<std::atomic<uint64_t>, EventWords> words;
+    };
+
+    std::array<EventSlot, EventCapacity> eventSlots;
+    std::atomic<uint64_t> lastSequence; //!< The sequence of the last event that was started
+}
+
+uint64_t get_time_ns() {
+    timespec time{};
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return static_cast<uint64_t>(time.tv_sec) * 1000000000 + static_cast<uint64_t>(time.tv_nsec);
+}
+
+void event_log_record(linkernsbypass_event event, const char *name) {
+    event.sequence = lastSequence.fetch_add(1, std::memory_order_relaxed) + 1;
+    event.timestamp_ns = get_time_ns();
+    event.thread = static_cast<uint64_t>(pthread_self());
+
+    if (name) {
+        // The end of a path is what identifies it, so keep that when truncating
+        size_t length{strlen(name)};
+        size_t kept{std::min(length, sizeof(event.name) - 1)};
+        memcpy(event.name, name + length - kept, kept);
+        event.name[kept] = '\0';
+    }
+
+    std::array<uint64_t, EventWords> words{};
+    memcpy(words.data(), &event, sizeof(event));
+
+    // A writer that's a whole lap ahead or behind can race this one for the slot, so it's claimed first and the event is dropped if the slot is busy or already holds a newer one
+    auto &slot{eventSlots[event.sequence & (EventCapacity - 1)]};
+    auto current{slot.sequence.load(std::memory_order_relaxed)};
+    do {
+        if (current == SlotWriting || current > event.sequence)
+            return;
+    } while (!slot.sequence.compare_exchange_weak(current, SlotWriting, std::memory_order_relaxed));
+    std::atomic_thread_fence(std::memory_order_release);
+    for (size_t i{}; i < EventWords; i++)
+        slot.words[i].store(words[i], std::memory_order_relaxed);
+    slot.sequence.store(event.sequence, std::memory_order_release);
+}
+
+void event_log_failure(uint32_t call, const char *name, int error) {
+    linkernsbypass_event event{};
+    event.unique_id = -1;
+    event.type = LINKERNSBYPASS_EVENT_FAILURE;
+    event.call = call;
+    event.error = error;
+    event_log_record(event, name);
+}
+
+/**
+ * @brief Reads the event with `sequence` from the log
+ * @return false if the event has already been overwritten or is still being written
+ */
+static bool read_event(uint64_t sequence, linkernsbypass_event &event) {
+    auto &slot{eventSlots[sequence & (EventCapacity - 1)]};
+    if (slot.sequence.load(std::memory_order_acquire) != sequence)
+        return false;
+
+    std::array<uint64_t, EventWords> words{};
+    for (size_t i{}; i < EventWords; i++)
+        words[i] = slot.words[i].load(std::memory_order_relaxed);
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (slot.sequence.load(std::memory_order_relaxed) != sequence)
+        return false;
+
+    memcpy(&event, words.data(), sizeof(event));
+    return true;
+}
+
+size_t linkernsbypass_get_events(linkernsbypass_event *events, size_t count) {
+    uint64_t last{lastSequence.load(std::memory_order_acquire)};
+    uint64_t first{last - std::min<uint64_t>({last, EventCapacity, count}) + 1};
+
+    size_t copied{};
+    for (uint64_t sequence{first}; sequence <= last; sequence++)
+        if (read_event(sequence, events[copied]))
+            copied++;
+
+    return copied;
+}
+
+bool linkernsbypass_dump_events(int fd) {
+    std::array<linkernsbypass_event, EventCapacity> events{};
+    size_t size{linkernsbypass_get_events(events.data(), events.size()) * sizeof(linkernsbypass_event)};
+
+    auto data{reinterpret_cast<const char *>(events.data())};
+    for (size_t written{}; written < size;) {
+        ssize_t ret{write(fd, data + written, size - written)};
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return false;
+        written += static_cast<size_t>(ret);
+    }
+
+    return true;
+}
@@ -0,0 +1,26 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright © 2021 Billy Laws
+
+#pragma once
+
+#include <cstdint>
+#include <errno.h>
+#include "android_linker_ns.h"
+
+/**
+ * @return The current CLOCK_MONOTONIC time in nanoseconds, this is what event timestamps and load stats are measured with
+ */
+uint64_t get_time_ns();
+
+/**
+ * @brief Records `event` in the load event log, filling in its sequence, timestamp and thread along with the end of `name`
+ * @note This is lock-free and never allocates or makes syscalls (CLOCK_MONOTONIC is read through the vDSO), so it can be used on every load
+ * @param name May be nullptr
+ */
+void event_log_record(linkernsbypass_event event, const char *name);
+
+/**
+ * @brief Records a failure of `call` in the load event log
+ * @param error Defaults to errno, so this must be called straight after the failing call before anything else can overwrite it
+ */
+void event_log_failure(uint32_t call, const char *name, int error = errno);
@@ -0,0 +1,65 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright © 2021 Billy Laws
+
+// libFuzzer harness for the soname patcher, every stage is run over the input as if it were a library from disk
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <climits>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <elf_soname_patcher.h>
+
+static int create_memfd(const char *name) {
+    return static_cast<int>(syscall(__NR_memfd_create, name, 0));
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    // Reused across runs, creating memfds for every input would dominate the fuzzing time
+    static int inputFd{create_memfd("elf_soname_patcher_fuzzer_input")};
+    static int targetFd{create_memfd("elf_soname_patcher_fuzzer_target")};
+    if (inputFd == -1 || targetFd == -1)
+        abort();
+
+    if (ftruncate(inputFd, 0) || pwrite(inputFd, data, size, 0) != static_cast<ssize_t>(size))
+        abort();
+
+    elf_soname_location location{};
+    if (!elf_soname_locate(inputFd, &location))
+        return 0;
+
+    // A located soname must always lie entirely within the file
+    if (location.size != size || location.offset > size || location.length > size - location.offset)
+        abort();
+
+    if (!elf_copy_file(inputFd, targetFd, location.size) || !elf_soname_write(targetFd, &location, "000"))
+        abort();
+
+    // The copy must match the input everywhere other than the patched soname
+    std::array<uint8_t, 4096> buffer{};
+    for (uint64_t offset{}; offset < size; offset += buffer.size()) {
+        auto chunk{static_cast<size_t>(std::min<uint64_t>(buffer.size(), size - offset))};
+        if (pread(targetFd, buffer.data(), chunk, static_cast<off_t>(offset)) != static_cast<ssize_t>(chunk))
+            abort();
+
+        for (size_t i{}; i < chunk; i++) {
+            uint64_t position{offset + i};
+            bool patched{position >= location.offset && position < location.offset + std::min<uint64_t>(location.length, 3)};
+            if (!patched && buffer[i] != data[position])
+                abort();
+        }
+    }
+
+    // Also go through the path based entry point
+    std::array<char, PATH_MAX> inputPath{};
+    snprintf(inputPath.data(), inputPath.size(), "/proc/self/fd/%d", inputFd);
+    if (!elf_soname_patch(inputPath.data(), targetFd, "000"))
+        abort();
+
+    return 0;
+}
@@ -0,0 +1,170 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright © 2021 Billy Laws
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <climits>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <link.h>
+#include <elf.h>
+#include "linker_symbol_cache.h"
+
+namespace {
+    constexpr uint32_t CacheMagic{0x53424e4c}; //!< 'LNBS'
+    constexpr uint32_t CacheVersion{1};
+    constexpr size_t MaxBuildIdSize{32};
+
+    struct CacheEntry {
+        std::array<uint8_t, MaxBuildIdSize> buildId; //!< The GNU build-id of the object containing the symbol
+        uint32_t buildIdSize;
+        uint64_t offset; //!< Offset of the symbol from the load bias of the object
+    };
+
+    struct CacheHeader {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t count;
+    };
+
+    struct LoadedObject {
+        uintptr_t base; //!< The load bias of the object
+        std::array<uint8_t, MaxBuildIdSize> buildId;
+        uint32_t buildIdSize;
+        std::vector<std::pair<uintptr_t, uintptr_t>> execRanges; //!< Executable segments of the object, as [start, end) addresses
+    };
+}
+
+static bool read_build_id(const dl_phdr_info *info, LoadedObject &object) {
+    for (ElfW(Half) i{}; i < info->dlpi_phnum; i++) {
+        auto &pHdr{info->dlpi_phdr[i]};
+        if (pHdr.p_type != PT_NOTE)
+            continue;
+
+        auto notes{reinterpret_cast<const uint8_t *>(info->dlpi_addr + pHdr.p_vaddr)};
+        for (ElfW(Word) offset{}; offset + sizeof(ElfW(Nhdr)) <= pHdr.p_memsz;) {
+            auto nHdr{reinterpret_cast<const ElfW(Nhdr) *>(notes + offset)};
+            auto nameSize{(nHdr->n_namesz + 3) & ~3U}, descSize{(nHdr->n_descsz + 3) & ~3U};
+            auto desc{notes + offset + sizeof(ElfW(Nhdr)) + nameSize};
+
+            if (nHdr->n_type == NT_GNU_BUILD_ID && nHdr->n_namesz == 4 && !memcmp(notes + offset + sizeof(ElfW(Nhdr)), "GNU", 4) &&
+                nHdr->n_descsz <= MaxBuildIdSize && offset + sizeof(ElfW(Nhdr)) + nameSize + nHdr->n_descsz <= pHdr.p_memsz) {
+                memcpy(object.buildId.data(), desc, nHdr->n_descsz);
+                object.buildIdSize = nHdr->n_descsz;
+                return true;
+            }
+
+            offset += sizeof(ElfW(Nhdr)) + nameSize + descSize;
+        }
+    }
+
+    return false;
+}
+
+static std::vector<LoadedObject> get_loaded_objects() {
+    std::vector<LoadedObject> objects;
+    dl_iterate_phdr([](dl_phdr_info *info, size_t, void *data) {
+        LoadedObject object{};
+        object.base = info->dlpi_addr;
+        if (!read_build_id(info, object))
+            return 0;
+
+        for (ElfW(Half) i{}; i < info->dlpi_phnum; i++) {
+            auto &pHdr{info->dlpi_phdr[i]};
+            if (pHdr.p_type == PT_LOAD && (pHdr.p_flags & PF_X))
+                object.execRanges.emplace_back(info->dlpi_addr + pHdr.p_vaddr, info->dlpi_addr + pHdr.p_vaddr + pHdr.p_memsz);
+        }
+
+        reinterpret_cast<std::vector<LoadedObject> *>(data)->push_back(object);
+        return 0;
+    }, &objects);
+
+    return objects;
+}
+
+static void get_cache_path(const char *cacheDir, std::array<char, PATH_MAX> &path) {
+    snprintf(path.data(), path.size(), "%s/linkernsbypass_symbols.bin", cacheDir);
+}
+
+bool linker_symbol_cache_load(const char *cacheDir, void **symbols, size_t count) {
+    std::array<char, PATH_MAX> cachePath{};
+    get_cache_path(cacheDir, cachePath);
+
+    int cacheFd{open(cachePath.data(), O_RDONLY | O_CLOEXEC)};
+    if (cacheFd == -1)
+        return false;
+
+    CacheHeader header{};
+    std::vector<CacheEntry> entries(count);
+    auto entriesSize{static_cast<ssize_t>(entries.size() * sizeof(CacheEntry))};
+    bool readCache{read(cacheFd, &header, sizeof(header)) == sizeof(header) && header.magic == CacheMagic && header.version == CacheVersion &&
+                   header.count == count && read(cacheFd, entries.data(), static_cast<size_t>(entriesSize)) == entriesSize};
+    close(cacheFd);
+    if (!readCache)
+        return false;
+
+    auto objects{get_loaded_objects()};
+    for (size_t i{}; i < count; i++) {
+        auto &entry{entries[i]};
+        auto object{std::find_if(objects.begin(), objects.end(), [&](const LoadedObject &object) {
+            return object.buildIdSize == entry.buildIdSize && !memcmp(object.buildId.data(), entry.buildId.data(), entry.buildIdSize);
+        })};
+        if (object == objects.end())
+            return false;
+
+        // Only accept entries that point into the code of the object, anything else means the cache is bogus
+        auto address{object->base + static_cast<uintptr_t>(entry.offset)};
+        if (std::none_of(object->execRanges.begin(), object->execRanges.end(), [address](auto &range) { return address >= range.first && address < range.second; }))
+            return false;
+
+        symbols[i] = reinterpret_cast<void *>(address);
+    }
+
+    return true;
+}
+
+void linker_symbol_cache_store(const char *cacheDir, void *const *symbols, size_t count) {
+    auto objects{get_loaded_objects()};
+
+    std::vector<CacheEntry> entries(count);
+    for (size_t i{}; i < count; i++) {
+        auto address{reinterpret_cast<uintptr_t>(symbols[i])};
+        auto object{std::find_if(objects.begin(), objects.end(), [address](const LoadedObject &object) {
+            return std::any_of(object.execRanges.begin(), object.execRanges.end(), [address](auto &range) { return address >= range.first && address < range.second; });
+        })};
+        if (object == objects.end())
+            return;
+
+        entries[i] = CacheEntry{
+            .buildId = object->buildId,
+            .buildIdSize = object->buildIdSize,
+            .offset = address - object->base
+        };
+    }
+
+    std::array<char, PATH_MAX> cachePath{}, tempPath{};
+    get_cache_path(cacheDir, cachePath);
+    snprintf(tempPath.data(), tempPath.size(), "%s.%d.tmp", cachePath.data(), getpid());
+
+    int tempFd{open(tempPath.data(), O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, S_IRUSR | S_IWUSR)};
+    if (tempFd == -1)
+        return;
+
+    CacheHeader header{
+        .magic = CacheMagic,
+        .version = CacheVersion,
+        .count = static_cast<uint32_t>(count)
+    };
+    auto entriesSize{static_cast<ssize_t>(entries.size() * sizeof(CacheEntry))};
+    bool written{write(tempFd, &header, sizeof(header)) == sizeof(header) && write(tempFd, entries.data(), static_cast<size_t>(entriesSize)) == entriesSize};
+    close(tempFd);
+
+    // Only a completely written cache is moved into place, so a reader never sees a partial one
+    if (!written || rename(tempPath.data(), cachePath.data()))
+        unlink(tempPath.data());
+}
@@ -0,0 +1,20 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright © 2021 Billy Laws
+
+#pragma once
+
+#include <cstddef>
+
+/**
+ * @brief Loads previously resolved linker entry points from the cache in `cacheDir`
+ * @note Every entry is stored as an offset from the load base of the object containing it, and is only used if an object with a matching GNU build-id is currently loaded
+ * @param symbols Filled with `count` addresses on success
+ * @return True if every entry in the cache could be validated
+ */
+bool linker_symbol_cache_load(const char *cacheDir, void **symbols, size_t count);
+
+/**
+ * @brief Records the `count` resolved linker entry points in `symbols` to the cache in `cacheDir`
+ * @note Nothing is written if any of the objects containing the entries lack a GNU build-id
+ */
+void linker_symbol_cache_store(const char *cacheDir, void *const *symbols, size_t count);
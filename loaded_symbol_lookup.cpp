@@ -0,0 +1,199 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright © 2021 Billy Laws
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <link.h>
+#include <elf.h>
+#include "loaded_symbol_lookup.h"
+
+namespace {
+    constexpr ElfW(Half) VersymHiddenBit{0x8000};
+
+    /**
+     * @brief The dynamic symbol tables of a loaded object, as addresses in the current process
+     */
+    struct DynamicTables {
+        uintptr_t bias{}; //!< The load bias of the object
+        const ElfW(Dyn) *dynamic{};
+        const uint32_t *gnuHash{};
+        const ElfW(Sym) *symTab{};
+        const char *strTab{};
+        const ElfW(Half) *verSym{}; //!< nullptr if the object has no symbol versions
+        const char *name{}; //!< The path of the object as reported by dl_iterate_phdr
+        const char *soname{}; //!< nullptr if the object has no DT_SONAME
+    };
+}
+
+static uint32_t gnu_hash(const char *name) {
+    uint32_t hash{5381};
+    for (; *name; name++)
+        hash = hash * 33 + static_cast<uint8_t>(*name);
+    return hash;
+}
+
+/**
+ * @brief Finds the dynamic section of the loaded object with a segment containing `anchor`
+ */
+static bool find_dynamic_tables(const void *anchor, DynamicTables &tables) {
+    struct Search {
+        uintptr_t address;
+        DynamicTables &tables;
+        bool found;
+    } search{reinterpret_cast<uintptr_t>(anchor), tables, false};
+
+    dl_iterate_phdr([](dl_phdr_info *info, size_t, void *data) {
+        auto &search{*static_cast<Search *>(data)};
+        const ElfW(Phdr) *dynamicHdr{};
+        bool contains{};
+        for (ElfW(Half) i{}; i < info->dlpi_phnum; i++) {
+            auto &pHdr{info->dlpi_phdr[i]};
+            if (pHdr.p_type == PT_DYNAMIC)
+                dynamicHdr = &pHdr;
+            else if (pHdr.p_type == PT_LOAD && search.address - (info->dlpi_addr + pHdr.p_vaddr) < pHdr.p_memsz)
+                contains = true;
+        }
+
+        if (!contains)
+            return 0;
+
+        search.found = dynamicHdr != nullptr;
+        if (search.found)
+            search.tables = {
+                .bias = info->dlpi_addr,
+                .dynamic = reinterpret_cast<const ElfW(Dyn) *>(info->dlpi_addr + dynamicHdr->p_vaddr),
+                .name = info->dlpi_name
+            };
+        return 1;
+    }, &search);
+
+    if (!search.found)
+        return false;
+
+    // Bionic never relocates .dynamic in place, so every pointer in it is still relative to the load bias
+    const ElfW(Dyn) *sonameEntry{};
+    for (auto entry{tables.dynamic}; entry->d_tag != DT_NULL; entry++) {
+        auto address{tables.bias + entry->d_un.d_ptr};
+        switch (entry->d_tag) {
+            case DT_GNU_HASH:
+                tables.gnuHash = reinterpret_cast<const uint32_t *>(address);
+                break;
+            case DT_SYMTAB:
+                tables.symTab = reinterpret_cast<const ElfW(Sym) *>(address);
+                break;
+            case DT_STRTAB:
+                tables.strTab = reinterpret_cast<const char *>(address);
+                break;
+            case DT_VERSYM:
+                tables.verSym = reinterpret_cast<const ElfW(Half) *>(address);
+                break;
+            case DT_SONAME:
+                sonameEntry = entry;
+                break;
+            default:
+                break;
+        }
+    }
+
+    if (sonameEntry && tables.strTab)
+        tables.soname = tables.strTab + sonameEntry->d_un.d_val;
+
+    return tables.gnuHash && tables.symTab && tables.strTab;
+}
+
+size_t loaded_symbol_lookup(const void *anchor, const char *const *names, size_t count, void **addresses) {
+    std::fill(addresses, addresses + count, nullptr);
+
+    DynamicTables tables{};
+    if (!find_dynamic_tables(anchor, tables))
+        return 0;
+
+    // https://sourceware.org/legacy-ml/binutils/2006-10/msg00377.html
+    constexpr uint32_t BloomBits{sizeof(ElfW(Addr)) * 8};
+    uint32_t bucketCount{tables.gnuHash[0]}, symOffset{tables.gnuHash[1]}, bloomSize{tables.gnuHash[2]}, bloomShift{tables.gnuHash[3]};
+    if (!bucketCount || !bloomSize)
+        return 0;
+
+    auto bloom{reinterpret_cast<const ElfW(Addr) *>(tables.gnuHash + 4)};
+    auto buckets{reinterpret_cast<const uint32_t *>(bloom + bloomSize)};
+    auto chains{buckets + bucketCount};
+
+    size_t resolved{};
+    for (size_t i{}; i < count; i++) {
+        auto hash{gnu_hash(names[i])};
+
+        // The bloom filter rejects most symbols the object doesn't define without touching the hash chains
+        auto bloomWord{bloom[(hash / BloomBits) % bloomSize]};
+        ElfW(Addr) bloomMask{(ElfW(Addr){1} << (hash % BloomBits)) | (ElfW(Addr){1} << ((hash >> bloomShift) % BloomBits))};
+        if ((bloomWord & bloomMask) != bloomMask)
+            continue;
+
+        for (uint32_t symIndex{buckets[hash % bucketCount]}; symIndex >= symOffset && symIndex; symIndex++) {
+            auto chainHash{chains[symIndex - symOffset]};
+            auto &sym{tables.symTab[symIndex]};
+            auto binding{ELF64_ST_BIND(sym.st_info)}, type{ELF64_ST_TYPE(sym.st_info)};
+
+            // Matches the checks done by the linker for dlsym without a version
+            if (((chainHash ^ hash) >> 1) == 0 && sym.st_shndx != SHN_UNDEF && (binding == STB_GLOBAL || binding == STB_WEAK) &&
+                type != STT_TLS && type != STT_GNU_IFUNC && !(tables.verSym && (tables.verSym[symIndex] & VersymHiddenBit)) &&
+                strcmp(tables.strTab + sym.st_name, names[i]) == 0) {
+                addresses[i] = reinterpret_cast<void *>(tables.bias + sym.st_value);
+                resolved++;
+                break;
+            }
+
+            // The lowest bit marks the end of the chain
+            if (chainHash & 1)
+                break;
+        }
+    }
+
+    return resolved;
+}
+
+bool loaded_object_is_needed(const void *anchor) {
+    DynamicTables tables{};
+    if (!find_dynamic_tables(anchor, tables))
+        return true;
+
+    // The linker matches DT_NEEDED against the soname, falling back to the filename for objects without one
+    struct Search {
+        uintptr_t bias;
+        const char *soname;
+        const char *filename;
+        bool needed;
+    } search{tables.bias, tables.soname, tables.name && strrchr(tables.name, '/') ? strrchr(tables.name, '/') + 1 : tables.name, false};
+
+    dl_iterate_phdr([](dl_phdr_info *info, size_t, void *data) {
+        auto &search{*static_cast<Search *>(data)};
+        if (info->dlpi_addr == search.bias)
+            return 0;
+
+        for (ElfW(Half) i{}; i < info->dlpi_phnum; i++) {
+            if (info->dlpi_phdr[i].p_type != PT_DYNAMIC)
+                continue;
+
+            auto dynamic{reinterpret_cast<const ElfW(Dyn) *>(info->dlpi_addr + info->dlpi_phdr[i].p_vaddr)};
+            const char *strTab{};
+            for (auto entry{dynamic}; entry->d_tag != DT_NULL; entry++)
+                if (entry->d_tag == DT_STRTAB)
+                    strTab = reinterpret_cast<const char *>(info->dlpi_addr + entry->d_un.d_ptr);
+
+            for (auto entry{dynamic}; strTab && entry->d_tag != DT_NULL; entry++) {
+                if (entry->d_tag != DT_NEEDED)
+                    continue;
+
+                const char *needed{strTab + entry->d_un.d_val};
+                if ((search.soname && strcmp(needed, search.soname) == 0) || (search.filename && strcmp(needed, search.filename) == 0)) {
+                    search.needed = true;
+                    return 1;
+                }
+            }
+            break;
+        }
+        return 0;
+    }, &search);
+
+    return search.needed;
+}
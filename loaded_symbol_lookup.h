@@ -0,0 +1,21 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright © 2021 Billy Laws
+
+#pragma once
+
+#include <cstddef>
+
+/**
+ * @brief Resolves symbols defined by the loaded object containing `anchor` by walking its .gnu.hash and .dynsym directly, without going through the linker for each symbol
+ * @note This follows the same rules as dlsym for unversioned lookups, TLS and IFUNC symbols are never resolved as they need the linker to produce an address
+ * @param addresses Filled with the address of each of the `count` symbols in `names`, or nullptr for those the object doesn't define
+ * @return The number of symbols that were resolved
+ */
+size_t loaded_symbol_lookup(const void *anchor, const char *const *names, size_t count, void **addresses);
+
+/**
+ * @brief Checks if any other loaded object has the object containing `anchor` in its DT_NEEDEDs
+ * @note If none does then a dlsym through a handle that returned `anchor` must have found it in the handle's own library, as lookups through a handle only search the library and its DT_NEEDED tree
+ * @return true if the object is needed by another one or couldn't be found
+ */
+bool loaded_object_is_needed(const void *anchor);
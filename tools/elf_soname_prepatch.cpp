@@ -0,0 +1,126 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright © 2021 Billy Laws
+
+// Writes soname patched variants of libraries ahead of time, so they can be shipped pre-patched and loaded with linkernsbypass_namespace_dlopen_prepatched without copying them on device
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <elf_soname_patcher.h>
+
+namespace {
+    constexpr char VariantMarker{'p'}; //!< Prefixed to the variant index in the soname patch, unique loads at runtime only ever use digits so the two can't collide
+    constexpr unsigned int MaxIdWidth{9};
+
+    bool make_directory(const char *path) {
+        return mkdir(path, 0755) == 0 || errno == EEXIST;
+    }
+
+    /**
+     * @brief Writes `variants` patched copies of `lib` to `<outputDir>/<variant>/<library filename>`
+     */
+    bool prepatch_lib(const char *lib, const char *outputDir, unsigned long variants, unsigned int width) {
+        int libFd{open(lib, O_RDONLY | O_CLOEXEC)};
+        elf_soname_location location{};
+        bool located{libFd != -1 && elf_soname_locate(libFd, &location)};
+        if (libFd != -1)
+            close(libFd);
+
+        if (!located) {
+            fprintf(stderr, "%s: not a readable elf with a soname\n", lib);
+            return false;
+        }
+
+        // The marker takes up one char of the soname on top of the ID
+        if (width + 1 > location.length) {
+            fprintf(stderr, "%s: soname is too short for a %u digit variant ID\n", lib, width);
+            return false;
+        }
+
+        const char *name{strrchr(lib, '/') ? strrchr(lib, '/') + 1 : lib};
+        for (unsigned long variant{}; variant < variants; variant++) {
+            std::array<char, PATH_MAX> path{};
+            snprintf(path.data(), path.size(), "%s/%lu", outputDir, variant);
+            if (!make_directory(path.data())) {
+                fprintf(stderr, "%s: failed to create directory: %s\n", path.data(), strerror(errno));
+                return false;
+            }
+
+            snprintf(path.data(), path.size(), "%s/%lu/%s", outputDir, variant, name);
+            int targetFd{open(path.data(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)};
+            if (targetFd == -1) {
+                fprintf(stderr, "%s: failed to create: %s\n", path.data(), strerror(errno));
+                return false;
+            }
+
+            std::array<char, MaxIdWidth + 2> sonamePatch{};
+            snprintf(sonamePatch.data(), sonamePatch.size(), "%c%0*lu", VariantMarker, static_cast<int>(width), variant);
+
+            bool patched{elf_soname_patch(lib, targetFd, sonamePatch.data())};
+            close(targetFd);
+            if (!patched) {
+                fprintf(stderr, "%s: failed to patch: %s\n", path.data(), strerror(errno));
+                unlink(path.data());
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    void print_usage(const char *argv0) {
+        fprintf(stderr, "Usage: %s [-n variants] [-w id width] -o output dir library...\n", argv0);
+    }
+}
+
+int main(int argc, char **argv) {
+    unsigned long variants{1};
+    unsigned int width{3};
+    const char *outputDir{};
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:w:o:h")) != -1) {
+        if (opt == 'n') {
+            variants = std::max(1UL, strtoul(optarg, nullptr, 10));
+        } else if (opt == 'w') {
+            width = std::clamp(static_cast<unsigned int>(strtoul(optarg, nullptr, 10)), 1U, MaxIdWidth);
+        } else if (opt == 'o') {
+            outputDir = optarg;
+        } else {
+            print_usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (!outputDir || optind >= argc) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    unsigned long limit{1};
+    for (unsigned int i{}; i < width; i++)
+        limit *= 10;
+
+    if (variants > limit) {
+        fprintf(stderr, "%lu variants don't fit in a %u digit ID\n", variants, width);
+        return 1;
+    }
+
+    if (!make_directory(outputDir)) {
+        fprintf(stderr, "%s: failed to create directory: %s\n", outputDir, strerror(errno));
+        return 1;
+    }
+
+    for (int i{optind}; i < argc; i++)
+        if (!prepatch_lib(argv[i], outputDir, variants, width))
+            return 1;
+
+    return 0;
+}
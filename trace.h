@@ -0,0 +1,31 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright © 2021 Billy Laws
+
+#pragma once
+
+#include <atomic>
+#include <android/trace.h>
+
+inline std::atomic<bool> TracingEnabled{}; //!< If ATrace sections should be emitted, set through linkernsbypass_set_tracing
+
+/**
+ * @brief Emits an ATrace section for its lifetime when tracing has been enabled, this costs a single relaxed load otherwise
+ */
+class TraceSection {
+  private:
+    bool active;
+
+  public:
+    TraceSection(const char *name) : active{TracingEnabled.load(std::memory_order_relaxed) && ATrace_isEnabled()} {
+        if (active)
+            ATrace_beginSection(name);
+    }
+
+    ~TraceSection() {
+        if (active)
+            ATrace_endSection();
+    }
+
+    TraceSection(const TraceSection &) = delete;
+    TraceSection &operator=(const TraceSection &) = delete;
+};